@@ -25,30 +25,182 @@
 
 #include "CommandHandler.h"
 
+#include <limits.h>
+#include <math.h>
+
 /**
  * Constructor allowing to change default delim and term
- * Example: SerialCommand sCmd(" ", ';');
+ * Example: CommandHandler sCmd(" ", ';');
  * Default are COMMANDHANDLER_DEFAULT_DELIM and COMMANDHANDLER_DEFAULT_TERM
+ * The buffers are owned by the subclass, see CommandHandlerT
  */
-CommandHandler::CommandHandler(const char *newdelim, char newterm)
+CommandHandlerBase::CommandHandlerBase(const char *newdelim, char newterm,
+                                       char *newbuffer, byte newbufferSize,
+                                       CommandHandlerToken *newtokens, byte newtokenCapacity,
+                                       char *newcommand, byte newcommandSize, byte newnameLength)
   : commandList(NULL),
     commandCount(0),
-    relayList(NULL),
-    relayCount(0),
+    nameLength(newnameLength),
+    commandTable(NULL),
+    commandTableCount(0),
+    commandTableSorted(true),
+    argErrorHandler(NULL),
     defaultHandler(NULL),
     pt2defaultHandlerObject(NULL),
     wrapper_defaultHandler(NULL),
-    term(newterm),           // asssign new terminator for commands
-    last(NULL),
-    delim(newdelim) // assign new delimitor
+    delim(newdelim), // assign new delimitor
+    term(newterm),   // asssign new terminator for commands
+    buffer(newbuffer),
+    bufferSize(newbufferSize),
+    tokens(newtokens),
+    tokenCapacity(newtokenCapacity),
+    command(newcommand),
+    commandSize(newcommandSize)
 {
+  // set of delimiters, as a bitmap for isDelim()
+  memset(delimMap, 0, sizeof(delimMap));
+  delimMap[0] = 1; // STRING_NULL_TERM
+  for (const char *c = delim; *c != STRING_NULL_TERM; c++) {
+    byte b = *c;
+    if (b < 128) {
+      delimMap[b >> 3] |= 1 << (b & 7);
+    }
+  }
+
+  // entries of the dictionary only store nameLength chars of the command
+  callbackSize = offsetof(CommandHandlerCallback, command) + nameLength + 1;
+  callbackSize = (callbackSize + alignof(CommandHandlerCallback) - 1) / alignof(CommandHandlerCallback) * alignof(CommandHandlerCallback);
+
   inCmdStream = &Serial;
   outCmdStream = &Serial;
 
-  commandHeader = String("");
+  commandHeader = NULL;
+  commandHeaderDelim = false;
   commandDecimal = 2;
-
+  commandStreaming = false;
+  txQueue = NULL;
+  batching = false;
+  batchLength = 0;
+  clearCmd();
+
+  inputs = NULL;
+  inputStream = NULL;
+  replyStream = NULL;
+  bufferOwner = NULL;
+  frameQueue = NULL;
+  dispatchingPending = false;
   clearBuffer();
+  frame.command = NULL;
+  frame.data = buffer;
+  frame.length = 0;
+  frame.tokens = NULL;
+  frame.tokenCount = 0;
+  frame.tokenPos = 0;
+  frame.scanPos = 0;
+  frame.argPos = 0;
+  frame.argScanPos = 0;
+}
+
+/**
+ * Constructor sharing the input and out command buffers of owner, see CommandHandlerShared
+ */
+CommandHandlerBase::CommandHandlerBase(CommandHandlerBase &owner, const char *newdelim, char newterm)
+  : CommandHandlerBase(newdelim, newterm, owner.buffer, owner.bufferSize, owner.tokens, owner.tokenCapacity,
+                       owner.command, owner.commandSize, owner.nameLength)
+{
+  bufferOwner = (owner.bufferOwner != NULL) ? owner.bufferOwner : &owner;
+}
+
+/**
+ * Binary search of the dictionary, which is kept sorted by command name.
+ * Returns the index of the matching entry, or -1 if none matches. In the latter
+ * case insertAt (if given) receives the index at which the command should be
+ * inserted to keep the dictionary sorted.
+ */
+int CommandHandlerBase::findCallback(const char *command, byte *insertAt) {
+  int low = 0;
+  int high = commandCount - 1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    int cmp = strncmp(command, callbackAt(mid)->command, nameLength);
+    if (cmp == 0) {
+      return mid;
+    } else if (cmp < 0) {
+      high = mid - 1;
+    } else {
+      low = mid + 1;
+    }
+  }
+  if (insertAt != NULL) {
+    *insertAt = low;
+  }
+  return -1;
+}
+
+/**
+ * Entry of the dictionary at index, entries are callbackSize bytes apart.
+ */
+CommandHandlerCallback *CommandHandlerBase::callbackAt(byte index) {
+  return (CommandHandlerCallback *) ((char *) commandList + index * callbackSize);
+}
+
+/**
+ * Look a command up in the flash table first, then in the dictionary.
+ * On success the entry is copied to callback, wherever it is stored, except
+ * for the command name.
+ */
+bool CommandHandlerBase::lookupCallback(const char *command, CommandHandlerCallback *callback) {
+  int low = 0;
+  int high = commandTableCount - 1;
+  while (low <= high) {
+    int mid = commandTableSorted ? (low + high) / 2 : low;
+    int cmp = strncmp_P(command, commandTable[mid].command, nameLength);
+    if (cmp == 0) {
+      memcpy_P(callback, &commandTable[mid], offsetof(CommandHandlerCallback, command));
+      return true;
+    } else if (cmp < 0 && commandTableSorted) {
+      high = mid - 1;
+    } else {
+      low = mid + 1;
+    }
+  }
+
+  int index = findCallback(command);
+  if (index >= 0) {
+    memcpy(callback, callbackAt(index), offsetof(CommandHandlerCallback, command));
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Store a callback of any kind in the dictionary, at its sorted position.
+ * A command name is unique across kinds: adding a name that already exists
+ * replaces the previous callback, whether it was a command or a relay.
+ */
+void CommandHandlerBase::addCallback(const char *command, byte kind, CommandHandlerCallback::Function function, void* pt2Object) {
+  byte index;
+  int found = findCallback(command, &index);
+  if (found < 0) {
+    CommandHandlerCallback *grown = (CommandHandlerCallback *) realloc(commandList, (commandCount + 1) * callbackSize);
+    if (grown == NULL) {
+      return;
+    }
+    commandList = grown;
+    memmove(callbackAt(index + 1), callbackAt(index), (commandCount - index) * callbackSize);
+    strncpy(callbackAt(index)->command, command, nameLength);
+    callbackAt(index)->command[nameLength] = STRING_NULL_TERM;
+    commandCount++;
+  } else {
+    index = found;
+    if (callbackAt(index)->kind == CommandHandlerCallback::INDEXED_RELAY && callbackAt(index)->pt2Object != pt2Object) {
+      free(callbackAt(index)->pt2Object);  // array allocated by addIndexedRelay()
+    }
+  }
+  CommandHandlerCallback *callback = callbackAt(index);
+  callback->kind = kind;
+  callback->pt2Object = pt2Object;
+  callback->function = function;
 }
 
 /**
@@ -56,7 +208,7 @@ CommandHandler::CommandHandler(const char *newdelim, char newterm)
  * This is used for matching a found token in the buffer, and gives the pointer
  * to the handler function to deal with it.
  */
-void CommandHandler::addCommand(const char *command, void (*function)()) {
+void CommandHandlerBase::addCommand(const char *command, void (*function)()) {
   #ifdef COMMANDHANDLER_DEBUG
     Serial.print("Adding command (");
     Serial.print(commandCount);
@@ -64,10 +216,7 @@ void CommandHandler::addCommand(const char *command, void (*function)()) {
     Serial.println(command);
   #endif
 
-  commandList = (CommandHandlerCallback *) realloc(commandList, (commandCount + 1) * sizeof(CommandHandlerCallback));
-  strncpy(commandList[commandCount].command, command, COMMANDHANDLER_MAXCOMMANDLENGTH);
-  commandList[commandCount].function = function;
-  commandCount++;
+  addCallback(command, CommandHandlerCallback::COMMAND, function, NULL);
 }
 
 /**
@@ -75,30 +224,190 @@ void CommandHandler::addCommand(const char *command, void (*function)()) {
  * This is used for matching a found token in the buffer, and gives the pointer
  * to the handler function to deal with the remaining of the command
  */
-void CommandHandler::addRelay(const char *command, void (*function)(const char *, void*), void* pt2Object) {
+void CommandHandlerBase::addRelay(const char *command, void (*function)(const char *)) {
+  #ifdef COMMANDHANDLER_DEBUG
+    Serial.print("Adding relay (");
+    Serial.print(commandCount);
+    Serial.print("): ");
+    Serial.println(command);
+  #endif
+
+  addCallback(command, CommandHandlerCallback::RELAY, function, NULL);
+}
+
+void CommandHandlerBase::addRelay(const char *command, void (*function)(const char *, void*), void* pt2Object) {
+  #ifdef COMMANDHANDLER_DEBUG
+    Serial.print("Adding relay (");
+    Serial.print(commandCount);
+    Serial.print("): ");
+    Serial.println(command);
+  #endif
+
+  addCallback(command, CommandHandlerCallback::OBJECT_RELAY, function, pt2Object);
+}
+
+/**
+ * Use a dictionary declared at compile time and stored in flash, so that no
+ * memory is allocated for it at runtime. Entries must be sorted by command
+ * (strcmp order) for lookup to be a binary search, e.g.:
+ *
+ *   constexpr CommandHandlerCallback commands[] PROGMEM = {
+ *     COMMANDHANDLER_COMMAND("HELLO", sayHello),
+ *     COMMANDHANDLER_RELAY("M1", relayToM1),
+ *     COMMANDHANDLER_COMMAND("P", processCommand)
+ *   };
+ *   static_assert(commandHandlerTableSorted(commands), "commands must be sorted by name");
+ *   cmdHdl.setCommandTable(commands);
+ *
+ * An unsorted table still works but is searched linearly. This table is
+ * searched before the commands added with addCommand()/addRelay().
+ */
+void CommandHandlerBase::setCommandTable(const CommandHandlerCallback *table, byte count) {
+  commandTable = table;
+  commandTableCount = count;
+
+  commandTableSorted = true;
+  char previous[COMMANDHANDLER_MAXCOMMANDLENGTH + 1];
+  for (byte i = 1; i < count; i++) {
+    memcpy_P(previous, commandTable[i - 1].command, sizeof(previous));
+    if (strncmp_P(previous, commandTable[i].command, nameLength) > 0) {
+      #ifdef COMMANDHANDLER_DEBUG
+        Serial.println("Command table is not sorted, falling back to linear search");
+      #endif
+      commandTableSorted = false;
+      break;
+    }
+  }
+}
+
+/**
+ * Adds a "command" whose remaining is handed over to another command handler.
+ * The handler carries on with the tokens already found by this one, where they
+ * lie, instead of being given a copy to parse char by char with
+ * processString(). The remaining is thus split by the delim of this handler,
+ * not by the one of handler.
+ */
+void CommandHandlerBase::addRelay(const char *command, CommandHandlerBase &handler) {
   #ifdef COMMANDHANDLER_DEBUG
     Serial.print("Adding relay (");
-    Serial.print(relayCount);
+    Serial.print(commandCount);
     Serial.print("): ");
     Serial.println(command);
   #endif
 
-  relayList = (RelayHandlerCallback *) realloc(relayList, (relayCount + 1) * sizeof(RelayHandlerCallback));
-  strncpy(relayList[relayCount].command, command, COMMANDHANDLER_MAXCOMMANDLENGTH);
-  relayList[relayCount].pt2Object = pt2Object;
-  relayList[relayCount].function = function;
-  relayCount++;
+  addCallback(command, CommandHandlerCallback::HANDLER_RELAY, static_cast<void (*)()>(NULL), &handler);
+}
+
+/**
+ * Add a relay for prefix followed by a decimal index below count, e.g. "P0" to
+ * "P31" with prefix "P" and count 32, in a single dictionary entry. The
+ * remaining of the command is given to function along with the object at
+ * index, count objects being stride bytes apart from first. Without function,
+ * the objects are handlers, each carrying on with the command as with
+ * addRelay(command, handler). A command registered in full, e.g. "P3", takes
+ * precedence over the indexed relay. The index is written without leading
+ * zeros, and a prefix ending in a digit is refused, as it could never match.
+ */
+void CommandHandlerBase::addIndexedRelay(const char *prefix, void (*function)(const char *, void*), void *first, size_t stride, byte count) {
+  #ifdef COMMANDHANDLER_DEBUG
+    Serial.print("Adding indexed relay (");
+    Serial.print(commandCount);
+    Serial.print("): ");
+    Serial.println(prefix);
+  #endif
+
+  size_t length = strlen(prefix);
+  if (length == 0 || (prefix[length - 1] >= '0' && prefix[length - 1] <= '9')) {
+    #ifdef COMMANDHANDLER_DEBUG
+      Serial.println("Indexed relay prefix must not end with a digit");
+    #endif
+    return;
+  }
+
+  // the array is kept along with the entry, reused if it replaces one
+  CommandHandlerArray *array = NULL;
+  int found = findCallback(prefix);
+  if (found >= 0 && callbackAt(found)->kind == CommandHandlerCallback::INDEXED_RELAY) {
+    array = (CommandHandlerArray *) callbackAt(found)->pt2Object;
+  } else {
+    array = (CommandHandlerArray *) malloc(sizeof(CommandHandlerArray));
+    if (array == NULL) {
+      return;
+    }
+  }
+  array->first = first;
+  array->stride = stride;
+  array->count = count;
+  addCallback(prefix, CommandHandlerCallback::INDEXED_RELAY, function, array);
+}
+
+/**
+ * Lookup a command made of the prefix of an indexed relay and an index, and
+ * give the relay to the element at that index as a plain relay.
+ */
+bool CommandHandlerBase::lookupIndexed(char *command, CommandHandlerCallback *callback) {
+  char *digits = command + strlen(command);
+  while (digits > command && digits[-1] >= '0' && digits[-1] <= '9') {
+    digits--;
+  }
+  char *end = digits;
+  unsigned int index = 0;
+  for (; *end != STRING_NULL_TERM && end - digits < 3; end++) {
+    index = index * 10 + (*end - '0');
+  }
+  // "P07" is not "P7", as a name added in full would not be either
+  if (digits == command || end == digits || *end != STRING_NULL_TERM || (*digits == '0' && end - digits > 1)) {
+    return false;
+  }
+
+  char first = *digits;
+  *digits = STRING_NULL_TERM;
+  bool found = lookupCallback(command, callback);
+  *digits = first;
+  if (!found || callback->kind != CommandHandlerCallback::INDEXED_RELAY) {
+    return false;
+  }
+
+  const CommandHandlerArray *array = (const CommandHandlerArray *) callback->pt2Object;
+  if (index >= array->count) {
+    return false;
+  }
+  callback->pt2Object = (char *) array->first + index * array->stride;
+  callback->kind = (callback->function.objectRelay != NULL) ? CommandHandlerCallback::OBJECT_RELAY : CommandHandlerCallback::HANDLER_RELAY;
+  return true;
+}
+
+/**
+ * This sets up a handler to be called when an argument of a command added with
+ * a typed function is missing or invalid, instead of the function. It is given
+ * the command and the index of the argument, 0 being the first after the command.
+ */
+void CommandHandlerBase::setArgErrorHandler(void (*function)(const char *, byte)) {
+  argErrorHandler = function;
+}
+
+void CommandHandlerBase::argError(byte index) {
+  #ifdef COMMANDHANDLER_DEBUG
+    Serial.print("Bad argument ");
+    Serial.print(index);
+    Serial.print(" for ");
+    Serial.println(frame.command);
+  #endif
+
+  if (argErrorHandler != NULL) {
+    (*argErrorHandler)(frame.command, index);
+  }
 }
 
 /**
  * This sets up a handler to be called in the event that the receveived command string
  * isn't in the list of commands.
  */
-void CommandHandler::setDefaultHandler(void (*function)(const char *)) {
+void CommandHandlerBase::setDefaultHandler(void (*function)(const char *)) {
   defaultHandler = function;
 }
 
-void CommandHandler::setDefaultHandler(void (*function)(const char *, void*), void* pt2Object) {
+void CommandHandlerBase::setDefaultHandler(void (*function)(const char *, void*), void* pt2Object) {
   pt2defaultHandlerObject = pt2Object;
   wrapper_defaultHandler = function;
 }
@@ -106,415 +415,1909 @@ void CommandHandler::setDefaultHandler(void (*function)(const char *, void*), vo
 /**
  * Assign the default serial
  */
-void CommandHandler::setInCmdSerial(Stream &inStream) {
+void CommandHandlerBase::setInCmdSerial(Stream &inStream) {
   inCmdStream = &inStream;
 }
 
 /**
  * Check the default Serial
  */
-void CommandHandler::processSerial() {
+void CommandHandlerBase::processSerial() {
   processSerial(*inCmdStream);
 }
 
 /**
  * This checks the Serial stream for characters, and assembles them into a buffer.
+ * Available characters are read by blocks with readBytes() and parsed at once.
  * When the terminator character (default COMMANDHANDLER_DEFAULT_TERM) is seen, it starts parsing the
  * buffer for a prefix command, and calls handlers setup by addCommand() member
  */
-void CommandHandler::processSerial(Stream &inStream) {
-  while (inStream.available() > 0) {
-    char inChar = inStream.read();   // Read single available character, there may be more waiting
-    #ifdef COMMANDHANDLER_DEBUG
-      Serial.print("Serial: ");
-      Serial.println(inChar);   // Echo back to serial stream
-    #endif
-    processChar(inChar);
+void CommandHandlerBase::processSerial(Stream &inStream) {
+  flush();
+
+  while (readStream(inStream)) {
   }
 }
 
 /**
- * This iterate on a String char by char, and push them into a buffer.
- * When the terminator character (default COMMANDHANDLER_DEFAULT_TERM) is seen, it starts parsing the
- * buffer for a prefix command, and calls handlers setup by addCommand() member
+ * Read and parse a chunk of what is available on inStream, if any
  */
-void CommandHandler::processString(const char *inString) {
-  for (int i = 0; i < strlen(inString); i++){
-    char inChar = inString[i];
-    #ifdef COMMANDHANDLER_DEBUG
-      Serial.print("String: ");
-      Serial.println(inChar);   // Echo back to serial stream
-    #endif
-    processChar(inChar);
+bool CommandHandlerBase::readStream(Stream &inStream) {
+  char chunk[COMMANDHANDLER_SERIAL_CHUNK];
+  int available = inStream.available();
+  if (available <= 0) {
+    return false;
+  }
+  // only ask for what is available, readBytes() then never waits for its timeout
+  size_t length = (size_t) available < sizeof(chunk) ? available : sizeof(chunk);
+  length = inStream.readBytes(chunk, length);
+  if (length == 0) {
+    return false;
   }
+  inputStream = &inStream;
+  processBuffer(chunk, length);
+  inputStream = NULL;
+  return true;
 }
 
 /**
- * This add a characters to the buffer, and analyse the buffer.
- * When the terminator character (default COMMANDHANDLER_DEFAULT_TERM) is seen, it starts parsing the
- * buffer for a prefix command, and calls handlers setup by addCommand() member
+ * Read commands from the stream of input too, into the buffer of input, so
+ * that partial commands from different streams never mix. All inputs share
+ * the dictionary of this handler, which needs a single copy of it whatever
+ * the number of streams. Inputs are read by processInputs().
  */
-void CommandHandler::processChar(char inChar) {
-  if (inChar == term) {     // Check for the terminator (default '\r') meaning end of command
-    #ifdef COMMANDHANDLER_DEBUG
-      Serial.print("Received: ");
-      Serial.println(buffer);
-    #endif
-
-    char *command = strtok_r(buffer, delim, &last);   // Search for command at start of buffer
-    if (command != NULL) {
-      boolean matched = false;
-      // searching in commands
-      for (int i = 0; i < commandCount; i++) {
-        #ifdef COMMANDHANDLER_DEBUG
-          Serial.print("Comparing [");
-          Serial.print(command);
-          Serial.print("] to [");
-          Serial.print(commandList[i].command);
-          Serial.println("]");
-        #endif
-
-        // Compare the found command against the list of known commands for a match
-        if (strncmp(command, commandList[i].command, COMMANDHANDLER_MAXCOMMANDLENGTH) == 0) {
-          #ifdef COMMANDHANDLER_DEBUG
-            Serial.print("Matched Command: ");
-            Serial.println(command);
-          #endif
-
-          // Execute the stored handler function for the command
-          (*commandList[i].function)();
-          matched = true;
-          break;
-        }
-      }
-      // searching in relays
-      for (int i = 0; i < relayCount; i++) {
-        #ifdef COMMANDHANDLER_DEBUG
-          Serial.print("Comparing [");
-          Serial.print(command);
-          Serial.print("] to [");
-          Serial.print(relayList[i].command);
-          Serial.println("]");
-        #endif
+void CommandHandlerBase::addInput(CommandHandlerInput &input) {
+  CommandHandlerInput **last = &inputs;
+  while (*last != NULL) {
+    last = &(*last)->nextInput;
+  }
+  input.nextInput = NULL;
+  *last = &input;
+}
 
-        // Compare the found command against the relay list of known commands for a match
-        if (strncmp(command, relayList[i].command, COMMANDHANDLER_MAXCOMMANDLENGTH) == 0) {
-          #ifdef COMMANDHANDLER_DEBUG
-            Serial.print("Matched Relay: ");
-            Serial.println(command);
-          #endif
-
-          // Execute the stored handler function for the command
-          (*relayList[i].function)(remaining(), relayList[i].pt2Object);
-          matched = true;
-          break;
-        }
-      }
-      if (!matched){
-        if (defaultHandler != NULL) {
-          (*defaultHandler)(command);
-        } else if (pt2defaultHandlerObject != NULL) {
-          (*wrapper_defaultHandler)(command, pt2defaultHandlerObject);
-        }
-      }
+/**
+ * Read what is available on each input, a chunk at a time from each in turn,
+ * until none has more. A busy stream thus does not hold back the others.
+ */
+void CommandHandlerBase::processInputs() {
+  flush();
+
+  bool more = true;
+  while (more) {
+    more = false;
+    for (CommandHandlerInput *input = inputs; input != NULL; input = input->nextInput) {
+      swapInput(*input);
+      more |= readStream(input->stream);
+      swapInput(*input);
     }
-    clearBuffer();
   }
-  else if (isprint(inChar)) {     // Only printable characters into the buffer
-    if (bufPos < COMMANDHANDLER_BUFFER) {
-      buffer[bufPos] = inChar;  // Put character into buffer
-      buffer[bufPos+1] = STRING_NULL_TERM;      // Null terminate
-      bufPos++;
-    } else {
-      #ifdef COMMANDHANDLER_DEBUG
-        Serial.println("Line buffer is full - increase COMMANDHANDLER_BUFFER");
-      #endif
+}
+
+bool CommandHandlerBase::isInput(Stream *stream) {
+  for (CommandHandlerInput *input = inputs; input != NULL; input = input->nextInput) {
+    if (&input->stream == stream) {
+      return true;
     }
   }
+  return false;
 }
 
-/*
- * Clear the input buffer.
- */
-void CommandHandler::clearBuffer() {
-  buffer[0] = STRING_NULL_TERM;
-  bufPos = 0;
+template <typename T>
+static inline void swapValues(T &a, T &b) {
+  T c = a;
+  a = b;
+  b = c;
 }
 
 /**
- * Retrieve the next token ("word" or "argument") from the command buffer.
- * Returns NULL if no more tokens exist.
+ * A shared handler is fed from within a callback of its owner, in the receive
+ * buffer the owner is currently using: its own while processSerial() reads,
+ * that of an input while processInputs() reads it. The partial command of
+ * another stream, kept in the other buffers, is then left untouched.
  */
-char *CommandHandler::next() {
-  return strtok_r(NULL, delim, &last);
+inline void CommandHandlerBase::followOwner() {
+  if (bufferOwner != NULL) {
+    buffer = bufferOwner->buffer;
+    bufferSize = bufferOwner->bufferSize;
+    tokens = bufferOwner->tokens;
+    tokenCapacity = bufferOwner->tokenCapacity;
+  }
 }
 
 /**
- * Returns char* of the remaining of the command buffer (for getting arguments to commands).
- * Returns NULL if no more tokens exist.
+ * Whether this handler is fed from within dispatchPending() of the handler
+ * owning its receive buffer. The producer of the frame queue, possibly an
+ * interrupt, is filling that buffer, so such commands are dropped instead.
+ * processChar() is left to the producer, it may interrupt dispatchPending().
  */
-char *CommandHandler::remaining() {
-
-  //reinit the remains char
-  remains[0] = STRING_NULL_TERM;
-
-  char str_term[2];
-  str_term[0] = term;
-  str_term[1] = STRING_NULL_TERM;
-
-   // Search for the remaining up to next term
-  char *command = strtok_r(NULL, str_term, &last);
-
-  // forge term in string format
-  strcpy(remains, command);
-  strcat(remains, str_term);
-
-  // clear the buffer now, we emptied the current command
-  // the remaining is might be given to another handler
-  // or it might used by the same commandHandler instance
-  // hence the buffer should be emptied now
-  clearBuffer();
-
-  return remains;
+inline bool CommandHandlerBase::feedingPending() {
+  const CommandHandlerBase *owner = (bufferOwner != NULL) ? bufferOwner : this;
+  if (owner->dispatchingPending) {
+    #ifdef COMMANDHANDLER_DEBUG
+      Serial.println("Command fed from dispatchPending() dropped");
+    #endif
+    return true;
+  }
+  return false;
 }
 
-
-
-/*****************************************
- * Helpers to read args and cast them into specific type, strongly inspired by CmdMessenger
- *****************************************/
-
 /**
- * Read the next argument as int16
+ * Exchange the parse state of this handler and input, done again to restore them
  */
-int CommandHandler::readIntArg() {
-  char *arg;
-  arg = next();
-  if (arg != NULL) {
-    argOk = true;
-    return atoi(arg);
-  }
-  argOk = false;
-  return 0;
+void CommandHandlerBase::swapInput(CommandHandlerInput &input) {
+  swapValues(buffer, input.buffer);
+  swapValues(bufferSize, input.bufferSize);
+  swapValues(bufPos, input.bufPos);
+  swapValues(tokens, input.tokens);
+  swapValues(tokenCapacity, input.tokenCapacity);
+  swapValues(tokenCount, input.tokenCount);
+  swapValues(inToken, input.inToken);
+  swapValues(tokenOverflow, input.tokenOverflow);
 }
 
-/**
- * Read the next argument as int32
- */
-long CommandHandler::readLongArg() {
-  char *arg;
-  arg = next();
-  if (arg != NULL) {
-    argOk = true;
-    return atol(arg);
-  }
-  argOk = false;
-  return 0L; // 'L' to force the constant into a long data format
+CommandHandlerInput::CommandHandlerInput(Stream &newstream, char *newbuffer, byte newbufferSize,
+                                         CommandHandlerToken *newtokens, byte newtokenCapacity)
+  : stream(newstream),
+    nextInput(NULL),
+    buffer(newbuffer),
+    bufferSize(newbufferSize),
+    bufPos(0),
+    tokens(newtokens),
+    tokenCapacity(newtokenCapacity),
+    tokenCount(0),
+    inToken(false),
+    tokenOverflow(false)
+{
+  buffer[0] = STRING_NULL_TERM;
 }
 
-/**
- * Read the next argument as bool
- */
-bool CommandHandler::readBoolArg() {
-  return (readIntArg() != 0) ? true : false;
+Stream &CommandHandlerInput::getStream() {
+  return stream;
 }
 
 /**
- * Read the next argument as float
+ * This iterate on a String char by char, and push them into a buffer.
+ * When the terminator character (default COMMANDHANDLER_DEFAULT_TERM) is seen, it starts parsing the
+ * buffer for a prefix command, and calls handlers setup by addCommand() member
  */
-float CommandHandler::readFloatArg() {
-  char *arg;
-  arg = next();
-  if (arg != NULL) {
-    argOk = true;
-    return strtod(arg, NULL);
-  }
-  argOk = false;
-  return 0;
+void CommandHandlerBase::processString(const char *inString) {
+  processBuffer(inString, strlen(inString));
 }
 
 /**
- * Read the next argument as double
+ * Only printable characters go into the buffer, same as isprint() in the "C" locale
  */
-double CommandHandler::readDoubleArg() {
-  char *arg;
-  arg = next();
-  if (arg != NULL) {
-    argOk = true;
-    return strtod(arg, NULL);
-  }
-  argOk = false;
-  return 0;
+static inline bool isPrintable(char c) {
+  return c >= ' ' && c <= '~';
 }
 
 /**
- * Read next argument as string.
+ * Delimiters separate tokens, the null char written at the end of tokens too.
+ * One lookup in delimMap, only printable characters are ever in the buffer
+ * so the map covers 7-bit characters. The term is not in the map: it never
+ * reaches the buffer, processChar() compares each char to it and
+ * processBuffer() finds it with memchr().
+ *
+ * There is no SWAR/SSE2 path classifying 8 to 16 chars at once: tokens are
+ * indexed by indexChar() one char at a time as they arrive, so there is no
+ * run of bytes to classify in bulk, and the library targets microcontrollers
+ * without such instructions.
  */
-char* CommandHandler::readStringArg() {
-  char *arg;
-  arg = next();
-  if (arg != NULL) {
-    argOk = true;
-    return arg;
-  }
-  argOk = false;
-  return STRING_NULL_TERM;
+inline bool CommandHandlerBase::isDelim(char c) {
+  byte b = c;
+  return b < 128 && (delimMap[b >> 3] & (1 << (b & 7)));
 }
 
 /**
- * Compare the next argument with a string
+ * Record where tokens start and end as characters are stored, so that the
+ * command and its arguments are already split when the terminator comes.
+ * Tokens beyond the capacity of the index are found by scanning instead.
  */
-bool CommandHandler::compareStringArg(const char *stringToCompare) {
-  char *arg;
-  arg = next();
-  if (arg != NULL) {
-    return (strcmp(stringToCompare, arg) == 0) ? true : false;
+inline void CommandHandlerBase::indexChar(char inChar, byte pos) {
+  if (tokenOverflow) {
+    return;
+  }
+  if (isDelim(inChar)) {
+    if (inToken) {
+      tokens[tokenCount - 1].end = pos;
+      inToken = false;
+    }
+  } else if (!inToken) {
+    if (tokenCount < tokenCapacity) {
+      tokens[tokenCount].start = pos;
+      tokenCount++;
+      inToken = true;
+    } else {
+      tokenOverflow = true;
+    }
   }
-  return false;
 }
 
-/*****************************************
- * Forging and sending output commands
- *****************************************/
-
-
 /**
- * Set an header for the output command
+ * Push length characters into the buffer, and analyse the buffer.
+ * When the terminator character (default COMMANDHANDLER_DEFAULT_TERM) is seen, it starts parsing the
+ * buffer for a prefix command, and calls handlers setup by addCommand() member
+ * Characters are moved by runs up to the next terminator rather than one by one.
+ * data may be remaining(), that lies further in the buffer: runs are copied
+ * forward with memmove, and the length is never taken again from data.
  */
-void CommandHandler::setCmdHeader(const char *cmdHeader, bool addDelim) {
-
-  commandHeader = String(cmdHeader);
-
-  if (addDelim == true) {
-    commandHeader = commandHeader + String(delim);
+void CommandHandlerBase::processBuffer(const char *data, size_t length) {
+  if (feedingPending()) {
+    return;
   }
-
+  followOwner();
   #ifdef COMMANDHANDLER_DEBUG
-    Serial.print("Out Command Header is now ");
-    Serial.println(commandHeader);
+    Serial.print("Buffer: ");
+    Serial.write((const uint8_t *) data, length);
+    Serial.println();
   #endif
-}
 
-void CommandHandler::initCmd() {
+  const char *end = data + length;
+  while (data < end) {
+    const char *found = (const char *) memchr(data, term, end - data);
+    const char *runEnd = (found != NULL) ? found : end;
 
-  commandString = commandHeader;
+    while (data < runEnd && bufPos < bufferSize) {
+      size_t count = runEnd - data;
+      if (count > (size_t) (bufferSize - bufPos)) {
+        count = bufferSize - bufPos;
+      }
+      char *run = buffer + bufPos;
+      memmove(run, data, count);
+      data += count;
+
+      // drop non printable characters, leaving room for more of the run if any,
+      // and index tokens on the way
+      char *out = run;
+      for (size_t i = 0; i < count; i++) {
+        char inChar = run[i];
+        if (isPrintable(inChar)) {
+          indexChar(inChar, out - buffer);
+          *out++ = inChar;
+        }
+      }
+      bufPos = out - buffer;
+    }
+    buffer[bufPos] = STRING_NULL_TERM;      // Null terminate
 
-  #ifdef COMMANDHANDLER_DEBUG
-    Serial.print("Out command is now ");
-    Serial.println(commandString);
+    if (data < runEnd) {
+      #ifdef COMMANDHANDLER_DEBUG
+        Serial.println("Line buffer is full - increase the buffer size");
+      #endif
+    }
+
+    if (found == NULL) {
+      break;
+    }
+
+    processReceived();
+    data = found + 1;
+  }
+}
+
+/**
+ * This add a characters to the buffer, and analyse the buffer.
+ * When the terminator character (default COMMANDHANDLER_DEFAULT_TERM) is seen, it starts parsing the
+ * buffer for a prefix command, and calls handlers setup by addCommand() member
+ */
+void CommandHandlerBase::processChar(char inChar) {
+  followOwner();
+  if (inChar == term) {     // Check for the terminator (default '\r') meaning end of command
+    processReceived();
+  }
+  else if (isPrintable(inChar)) {     // Only printable characters into the buffer
+    if (bufPos < bufferSize) {
+      indexChar(inChar, bufPos);
+      buffer[bufPos] = inChar;  // Put character into buffer
+      buffer[bufPos+1] = STRING_NULL_TERM;      // Null terminate
+      bufPos++;
+    } else {
+      #ifdef COMMANDHANDLER_DEBUG
+        Serial.println("Line buffer is full - increase the buffer size");
+      #endif
+    }
+  }
+}
+
+/**
+ * The terminator was received: the buffer holds a complete command whose
+ * tokens are already indexed, dispatch it, or queue it, and get ready for the
+ * next one.
+ */
+void CommandHandlerBase::processReceived() {
+  #ifdef COMMANDHANDLER_DEBUG
+    Serial.print("Received: ");
+    Serial.println(buffer);
+  #endif
+
+  if (frameQueue != NULL) {
+    frameQueue->push(buffer, bufPos, inputStream, millis());
+    clearBuffer();
+    return;
+  }
+
+  if (inToken) {
+    tokens[tokenCount - 1].end = bufPos;
+  }
+
+  frame.data = buffer;
+  frame.length = bufPos;
+  frame.tokens = tokens;
+  frame.tokenCount = tokenCount;
+  frame.tokenPos = 0;
+  // without overflow, the index holds every token and there is nothing to scan
+  frame.scanPos = tokenOverflow ? tokens[tokenCount - 1].end : bufPos;
+  dispatch(inputStream, millis());
+
+  clearBuffer();
+}
+
+/**
+ * Parse a complete command, without its terminator, directly where it lies.
+ * frame is tokenized in place and must stay untouched until this returns. It must
+ * have room for two more chars after length, for remaining() to append the term.
+ */
+void CommandHandlerBase::processFrame(char *data, size_t length) {
+  #ifdef COMMANDHANDLER_DEBUG
+    Serial.print("Frame: ");
+    Serial.write((const uint8_t *) data, length);
+    Serial.println();
   #endif
+
+  dispatchFrame(data, length, inputStream, millis());
+}
+
+void CommandHandlerBase::dispatchFrame(char *data, size_t length, Stream *origin, unsigned long time) {
+  data[length] = STRING_NULL_TERM;
+
+  // not indexed, tokens are all found by scanning
+  frame.data = data;
+  frame.length = length;
+  frame.tokens = NULL;
+  frame.tokenCount = 0;
+  frame.tokenPos = 0;
+  frame.scanPos = 0;
+  dispatch(origin, time);
+}
+
+/**
+ * Queue the commands received instead of dispatching them from processChar(),
+ * so that a slow callback does not hold up reception: processChar() can then
+ * be called from a serial interrupt, or serialEvent(), and dispatchPending()
+ * from loop(). The queue belongs to this handler only.
+ *
+ * The receive buffer then belongs to the producer: callbacks run by
+ * dispatchPending() must not feed commands to this handler, or to the
+ * handlers sharing its buffers. Those given to processString(),
+ * processBuffer(), processSerial() or processInputs() are dropped, while
+ * processChar() is only for the producer. Relays to handlers with addRelay() still work, they
+ * do not go through the receive buffer.
+ */
+void CommandHandlerBase::setFrameQueue(CommandHandlerFrameQueue &queue) {
+  frameQueue = &queue;
+}
+
+/**
+ * Dispatch up to maxFrames of the queued commands, oldest first, each from
+ * the slot it was queued in. Returns the number of commands dispatched.
+ */
+byte CommandHandlerBase::dispatchPending(byte maxFrames) {
+  byte count = 0;
+  if (frameQueue == NULL || dispatchingPending) {
+    return count;
+  }
+  dispatchingPending = true;
+  while (count < maxFrames && frameQueue->head != frameQueue->tail) {
+    char *slot = frameQueue->slotAt(frameQueue->head);
+    Stream *origin;
+    unsigned long time;
+    memcpy(&origin, slot, sizeof(origin));
+    memcpy(&time, slot + sizeof(origin), sizeof(time));
+    dispatchFrame(slot + CommandHandlerFrameQueue::slotHeader, (byte) slot[CommandHandlerFrameQueue::slotHeader - 1], origin, time);
+    // the slot is handed back to the producer only once dispatched
+    __asm__ __volatile__("" ::: "memory");
+    frameQueue->head = (frameQueue->head + 1) % frameQueue->slots;
+    count++;
+  }
+  dispatchingPending = false;
+  return count;
+}
+
+/**
+ * Look up the command at the cursor of the current frame and run its callback.
+ */
+CommandHandlerContext *CommandHandlerBase::currentContext = NULL;
+unsigned long CommandHandlerBase::commandSequence = 0;
+
+void CommandHandlerBase::dispatch(Stream *origin, unsigned long time) {
+  // a command received by this handler starts a context, a relayed one keeps
+  // the context of the command it comes from. Replies go back to an input
+  // added with addInput(), commands read with processSerial() keep replying
+  // on the out stream
+  CommandHandlerContext context;
+  bool received = (currentContext == NULL);
+  if (received) {
+    context.origin = origin;
+    context.time = time;
+    context.sequence = ++commandSequence;
+    context.reply = isInput(origin) ? origin : NULL;
+    currentContext = &context;
+  }
+  // only the handlers on the dispatch path reply to the context, other
+  // handlers keep their out stream
+  Stream *previousReply = replyStream;
+  replyStream = currentContext->reply;
+
+  // walk down the relays to other handlers in one pass over the tokens, the
+  // handler reached carries on with the frame and cursor of this one
+  CommandHandlerBase *handler = this;
+  CommandHandlerCallback callback;
+  bool matched = false;
+  char *command;
+  char *relay = NULL;
+  while ((command = next()) != NULL) {   // Search for command at start of buffer
+    #ifdef COMMANDHANDLER_DEBUG
+      Serial.print("Looking up [");
+      Serial.print(command);
+      Serial.println("]");
+    #endif
+
+    // one lookup for commands and relays alike, then for an indexed relay,
+    // whose prefix alone is no command
+    matched = handler->lookupCallback(command, &callback) && callback.kind != CommandHandlerCallback::INDEXED_RELAY;
+    if (!matched) {
+      matched = handler->lookupIndexed(command, &callback);
+    }
+    if (!matched || callback.kind != CommandHandlerCallback::HANDLER_RELAY) {
+      break;
+    }
+    handler = (CommandHandlerBase *) callback.pt2Object;
+    relay = command;
+  }
+
+  // a command ending on a relay to a handler, e.g. "M1;", goes with the relay
+  // name to the default handler of the handler reached, else of this one
+  if (command == NULL && relay != NULL) {
+    command = relay;
+    matched = false;
+    if (handler->defaultHandler == NULL && handler->pt2defaultHandlerObject == NULL) {
+      handler = this;
+    }
+  }
+
+  if (command != NULL) {
+    if (handler != this) {
+      handler->frame = frame;
+    }
+    // the handler reached replies to the context as well
+    Stream *previousLeafReply = handler->replyStream;
+    handler->replyStream = currentContext->reply;
+    handler->frame.command = command;
+    // arguments follow the command, as seen by arg() and argCount()
+    handler->frame.argPos = frame.tokenPos;
+    handler->frame.argScanPos = frame.scanPos;
+
+    if (matched) {
+      #ifdef COMMANDHANDLER_DEBUG
+        Serial.print("Matched: ");
+        Serial.println(command);
+      #endif
+      handler->invoke(callback);
+    } else if (handler->defaultHandler != NULL) {
+      (*handler->defaultHandler)(command);
+    } else if (handler->pt2defaultHandlerObject != NULL) {
+      (*handler->wrapper_defaultHandler)(command, handler->pt2defaultHandlerObject);
+    }
+    handler->replyStream = previousLeafReply;
+  }
+
+  replyStream = previousReply;
+  if (received) {
+    currentContext = NULL;
+  }
+}
+
+/**
+ * Execute the stored handler function for the command
+ */
+void CommandHandlerBase::invoke(const CommandHandlerCallback &callback) {
+  switch (callback.kind) {
+    case CommandHandlerCallback::COMMAND:
+      (*callback.function.command)();
+      break;
+    case CommandHandlerCallback::RELAY:
+      (*callback.function.relay)(remaining());
+      break;
+    case CommandHandlerCallback::OBJECT_RELAY:
+      (*callback.function.objectRelay)(remaining(), callback.pt2Object);
+      break;
+    case CommandHandlerCallback::TYPED_COMMAND:
+      (*callback.function.typed)(*this, callback.pt2Object);
+      break;
+    case CommandHandlerCallback::HANDLER_RELAY:
+    case CommandHandlerCallback::INDEXED_RELAY:
+      break;   // followed by dispatch()
+  }
+}
+
+/**
+ * Where and when the command being dispatched was received. Commands relayed,
+ * through addRelay() or given to processString() from within a callback, keep
+ * the context of the command they come from. Returns NULL outside of a callback.
+ */
+const CommandHandlerContext *CommandHandlerBase::getContext() {
+  return currentContext;
+}
+
+/*
+ * Clear the input buffer.
+ */
+void CommandHandlerBase::clearBuffer() {
+  buffer[0] = STRING_NULL_TERM;
+  bufPos = 0;
+  tokenCount = 0;
+  inToken = false;
+  tokenOverflow = false;
+}
+
+/**
+ * Null terminate and return the token of the current frame at index.
+ */
+char *CommandHandlerBase::tokenAt(byte index) {
+  CommandHandlerToken *token = &frame.tokens[index];
+  frame.data[token->end] = STRING_NULL_TERM;
+  return frame.data + token->start;
+}
+
+/**
+ * Find the next token of the current frame from *pos, past the token index.
+ * The token is null terminated if terminate is true, and *pos moves past it.
+ * Returns NULL if no more tokens exist.
+ */
+char *CommandHandlerBase::scanToken(size_t *pos, bool terminate) {
+  char *data = frame.data;
+  size_t length = frame.length;
+  size_t i = *pos;
+  while (i < length && isDelim(data[i])) {
+    i++;
+  }
+  if (i >= length) {
+    *pos = length;
+    return NULL;
+  }
+  char *token = data + i;
+  while (i < length && !isDelim(data[i])) {
+    i++;
+  }
+  if (terminate) {
+    data[i] = STRING_NULL_TERM;
+  }
+  *pos = (i < length) ? i + 1 : length;
+  return token;
+}
+
+/**
+ * Retrieve the next token ("word" or "argument") from the command buffer.
+ * Returns NULL if no more tokens exist.
+ */
+char *CommandHandlerBase::next() {
+  if (frame.tokenPos < frame.tokenCount) {
+    return tokenAt(frame.tokenPos++);
+  }
+  return scanToken(&frame.scanPos, true);
+}
+
+/**
+ * Returns the argument at index (0 is the first one after the command),
+ * independently of next(). Returns NULL if there are not that many arguments.
+ */
+char *CommandHandlerBase::arg(byte index) {
+  if (frame.tokenCount > frame.argPos) {
+    byte indexed = frame.tokenCount - frame.argPos;
+    if (index < indexed) {
+      return tokenAt(frame.argPos + index);
+    }
+    index -= indexed;
+  }
+  size_t pos = frame.argScanPos;
+  char *token;
+  do {
+    token = scanToken(&pos, index == 0);
+  } while (token != NULL && index-- > 0);
+  return token;
+}
+
+/**
+ * Returns the number of arguments of the current command.
+ */
+byte CommandHandlerBase::argCount() {
+  byte count = 0;
+  if (frame.tokenCount > frame.argPos) {
+    count = frame.tokenCount - frame.argPos;
+  }
+  size_t pos = frame.argScanPos;
+  while (scanToken(&pos, false) != NULL) {
+    count++;
+  }
+  return count;
+}
+
+/**
+ * Returns char* of the remaining of the command buffer (for getting arguments to commands).
+ * Returns NULL if no more tokens exist.
+ */
+char *CommandHandlerBase::remaining() {
+  size_t start = frame.scanPos;
+  if (frame.tokenPos < frame.tokenCount) {
+    start = frame.tokens[frame.tokenPos].start;
+  }
+  while (start < frame.length && isDelim(frame.data[start])) {
+    start++;
+  }
+
+  // nothing is left to read from this frame
+  frame.tokenPos = frame.tokenCount;
+  frame.scanPos = frame.length;
+
+  char *remains = NULL;
+  if (start < frame.length) {
+    remains = frame.data + start;
+    size_t length = frame.length - start;
+
+    // tokens read ahead with arg() were null terminated, put a delimiter back
+    char *null;
+    while ((null = (char *) memchr(remains, STRING_NULL_TERM, length)) != NULL) {
+      *null = delim[0];
+    }
+
+    // forge term in string format, in place: the buffer has room for it
+    // after the null terminating the last character received
+    remains[length] = term;
+    remains[length + 1] = STRING_NULL_TERM;
+  }
+
+  // clear the buffer now, we emptied the current command
+  // the remaining is might be given to another handler
+  // or it might used by the same commandHandler instance
+  // hence the buffer should be emptied now
+  // remains lies past the command in the buffer, so it survives clearing, and
+  // is only overwritten from the start when fed back to this buffer
+  if (frame.data == buffer) {
+    clearBuffer();
+  }
+
+  return remains;
+}
+
+
+/*****************************************
+ * Helpers to read args and cast them into specific type, strongly inspired by CmdMessenger
+ *****************************************/
+
+/**
+ * Number parsers for the arguments. They read a whole token in a single pass,
+ * allow spaces around the number but nothing else, and tell whether the
+ * token was a valid number in range. None of them uses floating point but
+ * parseDouble(), and it does without strtod().
+ */
+static inline const char *skipSpaces(const char *s) {
+  while (*s == ' ') {
+    s++;
+  }
+  return s;
+}
+
+static inline bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+/**
+ * Parse the decimal digits ending the token, up to limit, detecting overflow.
+ */
+static bool parseMagnitude(const char *s, unsigned long limit, unsigned long *out) {
+  unsigned long value = 0;
+  const char *digits = s;
+  while (isDigit(*s)) {
+    byte digit = *s++ - '0';
+    if (value > (limit - digit) / 10) {
+      return false;
+    }
+    value = value * 10 + digit;
+  }
+  if (s == digits || *skipSpaces(s) != STRING_NULL_TERM) {
+    return false;
+  }
+  *out = value;
+  return true;
+}
+
+/**
+ * Parse a decimal integer in [min, max], detecting overflow.
+ */
+static bool parseLong(const char *s, long min, long max, long *out) {
+  s = skipSpaces(s);
+  bool negative = (*s == '-');
+  if (*s == '-' || *s == '+') {
+    s++;
+  }
+  // largest magnitude allowed, computed without overflowing for LONG_MIN
+  unsigned long limit = negative ? (unsigned long) (-(min + 1)) + 1 : (unsigned long) max;
+  unsigned long value;
+  if (!parseMagnitude(s, limit, &value)) {
+    return false;
+  }
+  *out = negative ? -(long) (value - 1) - 1 : (long) value;
+  return true;
+}
+
+/**
+ * Parse a decimal integer in [0, max], detecting overflow.
+ */
+static bool parseUnsigned(const char *s, unsigned long max, unsigned long *out) {
+  s = skipSpaces(s);
+  if (*s == '+') {
+    s++;
+  }
+  return parseMagnitude(s, max, out);
+}
+
+/**
+ * Parse a decimal number into a long scaled by 10^scale, e.g. "-1.2345" with
+ * scale 2 gives -123. Digits past the scale are rounded, half away from zero.
+ */
+static bool parseFixed(const char *s, byte scale, long *out) {
+  s = skipSpaces(s);
+  bool negative = (*s == '-');
+  if (*s == '-' || *s == '+') {
+    s++;
+  }
+  unsigned long limit = negative ? (unsigned long) LONG_MAX + 1 : (unsigned long) LONG_MAX;
+  unsigned long value = 0;
+  bool digits = false;
+  bool fraction = false;
+  bool roundUp = false;
+  byte decimals = 0;
+  for (;; s++) {
+    if (*s == '.' && !fraction) {
+      fraction = true;
+      continue;
+    }
+    if (!isDigit(*s)) {
+      break;
+    }
+    digits = true;
+    byte digit = *s - '0';
+    if (fraction && decimals >= scale) {
+      // past the scale, only the first digit matters for rounding
+      if (decimals == scale) {
+        roundUp = (digit >= 5);
+      }
+      decimals++;
+      continue;
+    }
+    if (value > (limit - digit) / 10) {
+      return false;
+    }
+    value = value * 10 + digit;
+    if (fraction) {
+      decimals++;
+    }
+  }
+  if (!digits || *skipSpaces(s) != STRING_NULL_TERM) {
+    return false;
+  }
+  for (; decimals < scale; decimals++) {
+    if (value > limit / 10) {
+      return false;
+    }
+    value *= 10;
+  }
+  if (roundUp) {
+    if (value == limit) {
+      return false;
+    }
+    value++;
+  }
+  *out = negative ? -(long) (value - 1) - 1 : (long) value;
+  return true;
+}
+
+// Mantissa of parseDouble(), as many digits as a double can hold are kept
+#if __SIZEOF_DOUBLE__ > 4
+  typedef unsigned long long mantissa_t;
+  #define MANTISSA_DIGITS 19
+#else
+  typedef unsigned long mantissa_t;
+  #define MANTISSA_DIGITS 9
+#endif
+
+// 10^(2^i), to scale the mantissa by any power of ten in a few products
+static const double powersOf10[] PROGMEM = {
+  1e1, 1e2, 1e4, 1e8, 1e16, 1e32,
+#if __SIZEOF_DOUBLE__ > 4
+  1e64, 1e128, 1e256
+#endif
+};
+
+/**
+ * Case insensitive match of word at s, returns the char after it or NULL.
+ */
+static const char *matchWord(const char *s, const char *word) {
+  for (; *word != STRING_NULL_TERM; s++, word++) {
+    if ((*s | 0x20) != *word) {
+      return NULL;
+    }
+  }
+  return s;
+}
+
+/**
+ * Parse a decimal number with optional fraction and exponent, or inf and nan,
+ * as strtod() would. A finite number too large for a double is an error.
+ */
+static bool parseDouble(const char *s, double *out) {
+  s = skipSpaces(s);
+  bool negative = (*s == '-');
+  if (*s == '-' || *s == '+') {
+    s++;
+  }
+
+  double value;
+  const char *end;
+  if ((end = matchWord(s, "inf")) != NULL) {
+    const char *infinity = matchWord(end, "inity");
+    s = (infinity != NULL) ? infinity : end;
+    value = INFINITY;
+  } else if ((end = matchWord(s, "nan")) != NULL) {
+    s = end;
+    value = NAN;
+  } else {
+    mantissa_t mantissa = 0;
+    byte mantissaDigits = 0;
+    int exponent = 0;
+    bool digits = false;
+    bool fraction = false;
+    for (;; s++) {
+      if (*s == '.' && !fraction) {
+        fraction = true;
+        continue;
+      }
+      if (!isDigit(*s)) {
+        break;
+      }
+      digits = true;
+      if (mantissaDigits < MANTISSA_DIGITS) {
+        mantissa = mantissa * 10 + (*s - '0');
+        if (mantissa != 0) {
+          mantissaDigits++;
+        }
+        if (fraction) {
+          exponent--;
+        }
+      } else if (!fraction) {
+        exponent++;   // digits past the precision of the mantissa
+      }
+    }
+    if (!digits) {
+      return false;
+    }
+    if (*s == 'e' || *s == 'E') {
+      s++;
+      bool negativeExponent = (*s == '-');
+      if (*s == '-' || *s == '+') {
+        s++;
+      }
+      if (!isDigit(*s)) {
+        return false;
+      }
+      int e = 0;
+      while (isDigit(*s)) {
+        if (e < 10000) {
+          e = e * 10 + (*s - '0');
+        }
+        s++;
+      }
+      exponent += negativeExponent ? -e : e;
+    }
+
+    value = mantissa;
+    if (mantissa != 0) {
+      // a positive power is gathered first and applied in a single product:
+      // the rounding of a chain of products overshoots the largest double
+      unsigned int e = (exponent < 0) ? -exponent : exponent;
+      double scale = 1;
+      for (byte i = 0; e != 0 && i < sizeof(powersOf10) / sizeof(powersOf10[0]); i++, e >>= 1) {
+        if (e & 1) {
+          double power;
+          memcpy_P(&power, &powersOf10[i], sizeof(power));
+          if (exponent < 0) {
+            value /= power;
+          } else {
+            scale *= power;
+          }
+        }
+      }
+      if (e != 0) {
+        value = (exponent < 0) ? 0 : INFINITY;
+      } else {
+        value *= scale;
+      }
+      if (isinf(value)) {
+        return false;
+      }
+    }
+  }
+
+  if (*skipSpaces(s) != STRING_NULL_TERM) {
+    return false;
+  }
+  *out = negative ? -value : value;
+  return true;
+}
+
+/**
+ * Read the next argument as int16
+ */
+int CommandHandlerBase::readIntArg() {
+  long value;
+  char *arg;
+  arg = next();
+  argOk = (arg != NULL) && parseLong(arg, INT_MIN, INT_MAX, &value);
+  return argOk ? (int) value : 0;
+}
+
+/**
+ * Read the next argument as int32
+ */
+long CommandHandlerBase::readLongArg() {
+  long value;
+  char *arg;
+  arg = next();
+  argOk = (arg != NULL) && parseLong(arg, LONG_MIN, LONG_MAX, &value);
+  return argOk ? value : 0L; // 'L' to force the constant into a long data format
+}
+
+/**
+ * Read the next argument as an unsigned integer of at most max, for readArg()
+ */
+unsigned long CommandHandlerBase::readUnsignedArg(unsigned long max) {
+  unsigned long value;
+  char *arg;
+  arg = next();
+  argOk = (arg != NULL) && parseUnsigned(arg, max, &value);
+  return argOk ? value : 0UL;
+}
+
+/**
+ * Read the next argument as a decimal number scaled by 10^scale, without
+ * floating point, e.g. "12.345" is read as 1235 with scale 2
+ */
+long CommandHandlerBase::readFixedArg(byte scale) {
+  long value;
+  char *arg;
+  arg = next();
+  argOk = (arg != NULL) && parseFixed(arg, scale, &value);
+  return argOk ? value : 0L;
+}
+
+/**
+ * Read the next argument as bool
+ */
+bool CommandHandlerBase::readBoolArg() {
+  return (readIntArg() != 0) ? true : false;
+}
+
+/**
+ * Read the next argument as float
+ */
+float CommandHandlerBase::readFloatArg() {
+  return readDoubleArg();
+}
+
+/**
+ * Read the next argument as double
+ */
+double CommandHandlerBase::readDoubleArg() {
+  double value;
+  char *arg;
+  arg = next();
+  argOk = (arg != NULL) && parseDouble(arg, &value);
+  return argOk ? value : 0;
+}
+
+/**
+ * Parsers of one element of an array, storing it at out
+ */
+static bool parseInt16Element(const char *s, byte /* scale */, byte *out) {
+  long value;
+  if (!parseLong(s, INT16_MIN, INT16_MAX, &value)) {
+    return false;
+  }
+  int16_t element = value;
+  memcpy(out, &element, sizeof(element));
+  return true;
+}
+
+static bool parseInt32Element(const char *s, byte /* scale */, byte *out) {
+  long value;
+  if (!parseLong(s, INT32_MIN, INT32_MAX, &value)) {
+    return false;
+  }
+  int32_t element = value;
+  memcpy(out, &element, sizeof(element));
+  return true;
+}
+
+static bool parseFixedElement(const char *s, byte scale, byte *out) {
+  long value;
+  if (!parseFixed(s, scale, &value) || value < INT32_MIN || value > INT32_MAX) {
+    return false;
+  }
+  int32_t element = value;
+  memcpy(out, &element, sizeof(element));
+  return true;
+}
+
+static bool parseFloatElement(const char *s, byte /* scale */, byte *out) {
+  double value;
+  if (!parseDouble(s, &value)) {
+    return false;
+  }
+  float element = value;
+  memcpy(out, &element, sizeof(element));
+  return true;
+}
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static int base64Digit(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+/**
+ * Unpack a token of big-endian values width bytes wide, in hex after
+ * COMMANDHANDLER_HEX_PREFIX or in base64 after COMMANDHANDLER_BASE64_PREFIX,
+ * into values from index *count on. Fails if the token is malformed, ends
+ * within a value, or holds more than max values in all.
+ */
+static bool unpackElements(const char *s, byte width, byte *values, size_t max, size_t *count) {
+  s = skipSpaces(s);
+  bool base64 = (*s++ == COMMANDHANDLER_BASE64_PREFIX);
+  byte digitBits = base64 ? 6 : 4;
+  unsigned int bits = 0;
+  byte bitCount = 0;
+  uint32_t value = 0;
+  byte bytes = 0;
+  for (; *s != STRING_NULL_TERM; s++) {
+    int digit = base64 ? base64Digit(*s) : hexDigit(*s);
+    if (digit < 0) {
+      break;
+    }
+    bits = (bits << digitBits) | digit;
+    bitCount += digitBits;
+    if (bitCount < 8) {
+      continue;
+    }
+    bitCount -= 8;
+    value = (value << 8) | ((bits >> bitCount) & 0xFF);
+    bits &= (1 << bitCount) - 1;
+    if (++bytes < width) {
+      continue;
+    }
+    if (*count == max) {
+      return false;
+    }
+    byte *out = values + *count * width;
+    if (width == sizeof(uint16_t)) {
+      uint16_t element = value;
+      memcpy(out, &element, sizeof(element));
+    } else {
+      memcpy(out, &value, sizeof(value));
+    }
+    (*count)++;
+    value = 0;
+    bytes = 0;
+  }
+  // base64 leaves the bits of a partial byte, padded with '='
+  if (base64) {
+    while (*s == '=') {
+      s++;
+    }
+  } else if (bitCount != 0) {
+    return false;
+  }
+  return bytes == 0 && *skipSpaces(s) == STRING_NULL_TERM;
+}
+
+/**
+ * Read the remaining arguments into values, width bytes each, until max
+ * values are read. A token starting with COMMANDHANDLER_HEX_PREFIX or
+ * COMMANDHANDLER_BASE64_PREFIX holds several values packed, otherwise it is
+ * one decimal value read by parse. argOk is false if a token is invalid, or
+ * if a packed token does not fit in values.
+ */
+size_t CommandHandlerBase::readArray(byte *values, size_t max, byte width,
+                                     bool (*parse)(const char *, byte, byte *), byte scale) {
+  size_t count = 0;
+  argOk = true;
+  char *arg;
+  while (count < max && (arg = next()) != NULL) {
+    char prefix = *skipSpaces(arg);
+    if (prefix == COMMANDHANDLER_HEX_PREFIX || prefix == COMMANDHANDLER_BASE64_PREFIX) {
+      argOk = unpackElements(arg, width, values, max, &count);
+    } else {
+      argOk = (*parse)(arg, scale, values + count * width);
+      if (argOk) {
+        count++;
+      }
+    }
+    if (!argOk) {
+      break;
+    }
+  }
+  return count;
 }
 
-void CommandHandler::addCmdDelim() {
+/**
+ * Read the remaining arguments as int16 into values, e.g. "WAVE,12,-34,56;"
+ * or packed "WAVE,#000CFFDE0038;". Returns the number of values read, at
+ * most max, further arguments are left to next().
+ */
+size_t CommandHandlerBase::readIntArray(int16_t *values, size_t max) {
+  return readArray((byte *) values, max, sizeof(int16_t), parseInt16Element, 0);
+}
 
-  commandString = commandString + String(delim);
+/**
+ * Read the remaining arguments as int32 into values, see readIntArray()
+ */
+size_t CommandHandlerBase::readLongArray(int32_t *values, size_t max) {
+  return readArray((byte *) values, max, sizeof(int32_t), parseInt32Element, 0);
+}
 
-  #ifdef COMMANDHANDLER_DEBUG
-    Serial.print("Out command is now ");
-    Serial.println(commandString);
-  #endif
+/**
+ * Read the remaining arguments as decimal numbers scaled by 10^scale into
+ * values, see readFixedArg(). Packed values are taken as already scaled.
+ */
+size_t CommandHandlerBase::readFixedArray(int32_t *values, size_t max, byte scale) {
+  return readArray((byte *) values, max, sizeof(int32_t), parseFixedElement, scale);
 }
-//
-void CommandHandler::addCmdTerm() {
 
-  commandString = commandString + String(term);
+/**
+ * Read the remaining arguments as float into values, see readIntArray().
+ * Packed values are IEEE 754 single precision.
+ */
+size_t CommandHandlerBase::readFloatArray(float *values, size_t max) {
+  return readArray((byte *) values, max, sizeof(float), parseFloatElement, 0);
+}
 
-  #ifdef COMMANDHANDLER_DEBUG
-    Serial.print("Out command is now ");
-    Serial.println(commandString);
-  #endif
+/**
+ * Read next argument as string.
+ */
+char* CommandHandlerBase::readStringArg() {
+  char *arg;
+  arg = next();
+  if (arg != NULL) {
+    argOk = true;
+    return arg;
+  }
+  argOk = false;
+  return NULL;
 }
 
-void CommandHandler::addCmdBool(bool value) {
+/**
+ * Compare the next argument with a string
+ */
+bool CommandHandlerBase::compareStringArg(const char *stringToCompare) {
+  char *arg;
+  arg = next();
+  if (arg != NULL) {
+    return (strcmp(stringToCompare, arg) == 0) ? true : false;
+  }
+  return false;
+}
 
-  commandString = commandString + String(value);
+/*****************************************
+ * Forging and sending output commands
+ *****************************************/
 
-  #ifdef COMMANDHANDLER_DEBUG
-    Serial.print("Out command is now ");
-    Serial.println(commandString);
-  #endif
+// "00" to "99", to format numbers two digits at a time
+static const char digitPairs[] PROGMEM =
+  "00010203040506070809101112131415161718192021222324"
+  "25262728293031323334353637383940414243444546474849"
+  "50515253545556575859606162636465666768697071727374"
+  "75767778798081828384858687888990919293949596979899";
+
+/**
+ * Format value in decimal backwards from end, with at least minDigits digits
+ * (zero padded), and return the first char.
+ */
+template <typename T>
+static char *formatDigits(char *end, T value, byte minDigits) {
+  char *s = end;
+  while (value >= 100) {
+    byte pair = value % 100;
+    value /= 100;
+    s -= 2;
+    memcpy_P(s, &digitPairs[pair * 2], 2);
+  }
+  if (value >= 10) {
+    s -= 2;
+    memcpy_P(s, &digitPairs[value * 2], 2);
+  } else {
+    *--s = '0' + value;
+  }
+  while (end - s < minDigits) {
+    *--s = '0';
+  }
+  return s;
+}
+
+#if __SIZEOF_DOUBLE__ > 4
+/**
+ * Format value with decimal digits after the point, backwards from end, as
+ * dtostrf() would but for the padding. The value is scaled to an integer
+ * exactly, from its binary mantissa and exponent, and rounded to nearest,
+ * half to even. Returns the first char, or NULL if the value or decimal is
+ * too large for a mantissa_t, for dtostrf() to format it instead.
+ *
+ * Only where double is 8 bytes: avr-libc dtostrf() rounds a 7 digit decimal
+ * approximation instead, e.g. 0.015f gives "0.02" with 2 decimals where the
+ * exact value rounds to "0.01", so 4-byte doubles are all left to dtostrf(),
+ * for out commands to stay as they were.
+ */
+static char *formatFixed(char *end, double value, byte decimal) {
+  char *s = end;
+  bool negative = signbit(value);
+  if (isnan(value)) {
+    s -= 3;
+    memcpy(s, "nan", 3);
+  } else if (isinf(value)) {
+    s -= 3;
+    memcpy(s, "inf", 3);
+  } else {
+    if (decimal > MANTISSA_DIGITS) {
+      return NULL;
+    }
+    // value = mantissa * 2^exponent
+    int exponent;
+    mantissa_t mantissa = ldexp(frexp(fabs(value), &exponent), __DBL_MANT_DIG__);
+    exponent -= __DBL_MANT_DIG__;
+    while (mantissa != 0 && (mantissa & 1) == 0) {
+      mantissa >>= 1;
+      exponent++;
+    }
+
+    // value * 10^decimal = mantissa * 5^decimal * 2^(exponent + decimal)
+    const mantissa_t mantissaMax = ~(mantissa_t) 0;
+    const byte mantissaBits = sizeof(mantissa_t) * 8;
+    mantissa_t power = 1;
+    for (byte i = 0; i < decimal; i++) {
+      power *= 10;
+    }
+    for (byte i = 0; i < decimal; i++) {
+      if (mantissa > mantissaMax / 5) {
+        return NULL;
+      }
+      mantissa *= 5;
+    }
+    int shift = exponent + decimal;
+    mantissa_t scaled;
+    if (mantissa == 0) {
+      scaled = 0;
+    } else if (shift >= 0) {
+      if (shift >= mantissaBits || mantissa > (mantissaMax >> shift)) {
+        return NULL;
+      }
+      scaled = mantissa << shift;
+    } else if (-shift > mantissaBits) {
+      scaled = 0;   // less than half the last digit
+    } else {
+      byte bits = -shift;
+      mantissa_t remainder;
+      if (bits == mantissaBits) {
+        scaled = 0;
+        remainder = mantissa;
+      } else {
+        scaled = mantissa >> bits;
+        remainder = mantissa & (((mantissa_t) 1 << bits) - 1);
+      }
+      mantissa_t half = (mantissa_t) 1 << (bits - 1);
+      if (remainder > half || (remainder == half && (scaled & 1))) {
+        scaled++;
+      }
+    }
+    mantissa_t integer = scaled / power;
+    if (decimal > 0) {
+      s = formatDigits(s, scaled - integer * power, decimal);
+      *--s = '.';
+    }
+    s = formatDigits(s, integer, 1);
+  }
+  if (negative) {
+    *--s = '-';
+  }
+  return s;
 }
+#endif
+
 
-void CommandHandler::addCmdInt(int value) {
+/**
+ * Set an header for the output command, written at the start of it by
+ * initCmd(). cmdHeader is copied, it can be a temporary buffer.
+ */
+void CommandHandlerBase::setCmdHeader(const char *cmdHeader, bool addDelim) {
 
-  commandString = commandString + String(value, DEC);
+  size_t length = strlen(cmdHeader);
+  char *copy = (char *) malloc(length + 1);
+  if (copy == NULL) {
+    return;
+  }
+  memcpy(copy, cmdHeader, length + 1);
+  free(commandHeader);
+  commandHeader = copy;
+  commandHeaderDelim = addDelim;
 
   #ifdef COMMANDHANDLER_DEBUG
-    Serial.print("Out command is now ");
-    Serial.println(commandString);
+    Serial.print("Out Command Header is now ");
+    Serial.println(commandHeader);
   #endif
 }
 
-void CommandHandler::addCmdLong(long value) {
-
-  commandString = commandString + String(value, DEC);
+/**
+ * Append length chars of value to the out command, if they all fit in its
+ * buffer, otherwise leave it as is and set cmdOk to false.
+ */
+void CommandHandlerBase::appendCmd(const char *value, size_t length) {
+  if (length > (size_t) (commandSize - commandLength)) {
+    if (!commandStreaming) {
+      if (batchLength == 0 || length > (size_t) (commandSize - (commandLength - batchLength))) {
+        cmdOk = false;
+        #ifdef COMMANDHANDLER_DEBUG
+          Serial.println("Out command full");
+        #endif
+        return;
+      }
+      // make room by writing the batched commands, see beginBatch()
+      writeCmd(*outCmdStream, command, batchLength);
+      commandLength -= batchLength;
+      memmove(command, command + batchLength, commandLength);
+      batchLength = 0;
+    } else {
+      // when streaming the out buffer only gathers small fields into one write
+      flushCmd();
+      if (length > commandSize) {
+        if (cmdStream().write((const uint8_t *) value, length) != length) {
+          cmdOk = false;
+        }
+        return;
+      }
+    }
+  }
+  memcpy(command + commandLength, value, length);
+  commandLength += length;
+  command[commandLength] = STRING_NULL_TERM;
 
   #ifdef COMMANDHANDLER_DEBUG
     Serial.print("Out command is now ");
-    Serial.println(commandString);
+    Serial.println(command);
   #endif
 }
 
+void CommandHandlerBase::initCmd() {
+  clearCmd();
+  if (commandHeader != NULL) {
+    addCmdString(commandHeader);
+  }
+  if (commandHeaderDelim) {
+    addCmdDelim();
+  }
+}
+
+void CommandHandlerBase::clearCmd() {
+  commandLength = batchLength;
+  command[commandLength] = STRING_NULL_TERM;
+  cmdOk = true;
+}
+
+void CommandHandlerBase::addCmdDelim() {
+  addCmdString(delim);
+}
+
+void CommandHandlerBase::addCmdTerm() {
+  appendCmd(&term, 1);
+  if (commandStreaming) {
+    if (batching) {
+      batchLength = commandLength;
+    } else {
+      flushCmd();
+    }
+  }
+}
+
+void CommandHandlerBase::addCmdBool(bool value) {
+  addCmdLong(value ? 1 : 0);
+}
+
+void CommandHandlerBase::addCmdInt(int value) {
+  addCmdLong(value);
+}
+
+void CommandHandlerBase::addCmdUnsigned(unsigned long value) {
+  char digits[3 * sizeof(long)];
+  char *end = digits + sizeof(digits);
+  char *s = formatDigits(end, value, 1);
+  appendCmd(s, end - s);
+}
+
+void CommandHandlerBase::addCmdLong(long value) {
+  char digits[3 * sizeof(long) + 1];
+  char *end = digits + sizeof(digits);
+  char *s = formatDigits(end, (value < 0) ? -(unsigned long) value : (unsigned long) value, 1);
+  if (value < 0) {
+    *--s = '-';
+  }
+  appendCmd(s, end - s);
+}
+
 
-void CommandHandler::setCmdDecimal(byte decimal) {
+void CommandHandlerBase::setCmdDecimal(byte decimal) {
   commandDecimal = decimal;
 }
 
-void CommandHandler::addCmdFloat(double value) {
+void CommandHandlerBase::addCmdFloat(double value) {
   addCmdFloat(value, commandDecimal);
 }
 
-void CommandHandler::addCmdFloat(float value, byte decimal) {
+void CommandHandlerBase::addCmdFloat(float value, byte decimal) {
+  addCmdDouble(value, decimal);
+}
 
+void CommandHandlerBase::addCmdDouble(double value) {
+  addCmdDouble(value, commandDecimal);
+}
 
-  commandString = commandString + String(value, decimal);
+/**
+ * Add value with decimal digits after the point, as String(value, decimal)
+ * did with dtostrf(), right-aligned in at least decimal + 2 chars. Values of
+ * 10^15 and more that do not fit in a mantissa_t are not added, and cmdOk
+ * turns false, where dtostrf() would overflow its buffer.
+ */
+void CommandHandlerBase::addCmdDouble(double value, byte decimal) {
+  char digits[33];
+  char *end = digits + sizeof(digits);
+#if __SIZEOF_DOUBLE__ > 4
+  char *s = formatFixed(end, value, decimal);
+#else
+  char *s = NULL;   // see formatFixed()
+#endif
+  if (s == NULL) {
+    // digits[] holds 15 digits on each side of the point, dtostrf() writes all of them
+    if (!isinf(value) && (decimal > 15 || fabs(value) >= 1e15)) {
+      cmdOk = false;
+      return;
+    }
+    dtostrf(value, decimal + 2, decimal, digits);
+    addCmdString(digits);
+    return;
+  }
+  while (end - s < decimal + 2) {
+    *--s = ' ';
+  }
+  appendCmd(s, end - s);
+}
 
-  #ifdef COMMANDHANDLER_DEBUG
-    Serial.print("Out command is now ");
-    Serial.println(commandString);
-  #endif
+void CommandHandlerBase::addCmdString(const char *value) {
+  appendCmd(value, strlen(value));
 }
 
-void CommandHandler::addCmdDouble(double value) {
-  addCmdDouble(value, commandDecimal);
+/**
+ * Add a string stored in flash, as given by F("...")
+ */
+void CommandHandlerBase::addCmdString(const __FlashStringHelper *value) {
+  PGM_P p = reinterpret_cast<PGM_P>(value);
+  size_t length = strlen_P(p);
+  if (!commandStreaming && length > (size_t) (commandSize - commandLength)) {
+    cmdOk = false;
+    return;
+  }
+  // copied to RAM a chunk at a time, as it may not fit in the out buffer when streaming
+  char chunk[16];
+  while (length > 0) {
+    size_t count = (length < sizeof(chunk)) ? length : sizeof(chunk);
+    memcpy_P(chunk, p, count);
+    appendCmd(chunk, count);
+    p += count;
+    length -= count;
+  }
 }
 
-void CommandHandler::addCmdDouble(double value, byte decimal) {
+/**
+ * The out command, null-terminated. It holds whatever fitted in its buffer,
+ * see cmdOk.
+ */
+char* CommandHandlerBase::getOutCmd() {
+  return command + batchLength;
+}
 
-  commandString = commandString + String(value, decimal);
+void CommandHandlerBase::setOutCmdSerial(Stream &outStream) {
+  outCmdStream = &outStream;
+}
 
-  #ifdef COMMANDHANDLER_DEBUG
-    Serial.print("Out command is now ");
-    Serial.println(commandString);
-  #endif
+/**
+ * In streaming mode, the out command is written to the out stream as it is
+ * built, instead of being kept whole until sendCmdSerial(). The out buffer
+ * then only gathers fields into larger writes, and is written when full and
+ * by addCmdTerm(), so commands can be longer than it, and getOutCmd() only
+ * returns what has not been written yet. cmdOk turns false if the stream
+ * does not take all the bytes.
+ */
+void CommandHandlerBase::setCmdStreaming(bool streaming) {
+  commandStreaming = streaming;
+  clearCmd();
+}
+
+/**
+ * Write what the out buffer holds to cmdStream() and empty it, when streaming
+ */
+void CommandHandlerBase::flushCmd() {
+  if (commandLength != 0 && cmdStream().write((const uint8_t *) command, commandLength) != commandLength) {
+    cmdOk = false;
+  }
+  commandLength = 0;
+  batchLength = 0;
+  command[0] = STRING_NULL_TERM;
 }
 
-void CommandHandler::addCmdString(const char *value) {
+/**
+ * Send the out command to the out stream, or back to the input it came from
+ * within a callback of this handler for a command read by processInputs().
+ */
+void CommandHandlerBase::sendCmdSerial() {
+  sendCmdSerial(cmdStream());
+}
 
-  commandString = commandString + String(value);
+/**
+ * Stream the out command goes to, see sendCmdSerial()
+ */
+Stream &CommandHandlerBase::cmdStream() {
+  return (replyStream != NULL) ? *replyStream : *outCmdStream;
+}
 
-  #ifdef COMMANDHANDLER_DEBUG
-    Serial.print("Out command is now ");
-    Serial.println(commandString);
-  #endif
+/**
+ * Send the out command to outStream, unless it did not fit in its buffer
+ * (cmdOk false), as a truncated command would be misread on the other end.
+ * When streaming, the command is already on its way to cmdStream() and
+ * only what is left in the out buffer is written to it: outStream is not
+ * used, the command cannot be redirected once started.
+ */
+void CommandHandlerBase::sendCmdSerial(Stream &outStream) {
+  if (commandStreaming) {
+    if (!batching) {
+      flushCmd();
+    }
+  } else if (cmdOk) {
+    if (batching && &outStream == outCmdStream) {
+      batchLength = commandLength;
+    } else {
+      writeCmd(outStream, command + batchLength, commandLength - batchLength);
+    }
+  }
+}
 
+/**
+ * Write to outStream, through the queue if it is the stream of the queue
+ */
+void CommandHandlerBase::writeCmd(Stream &outStream, const char *data, byte length) {
+  if (txQueue != NULL && &outStream == &txQueue->getStream()) {
+    txQueue->push(data, length);
+  } else {
+    outStream.write((const uint8_t *) data, length);
+  }
 }
 
-char* CommandHandler::getOutCmd() {
+/**
+ * Between beginBatch() and endBatch(), the out commands sent to the out stream
+ * are gathered in the out buffer and written at once by endBatch(), or
+ * earlier when the buffer is full. This saves the USB packets and polling
+ * slots that small separate writes each take on USB serial boards. When
+ * streaming, addCmdTerm() and sendCmdSerial() leave the out buffer to be
+ * written when full or by endBatch() likewise. As the out buffer, a batch is
+ * not shared between the handlers of a CommandHandlerShared tree.
+ */
+void CommandHandlerBase::beginBatch() {
+  batching = true;
+}
 
-  commandString.toCharArray(command, COMMANDHANDLER_BUFFER + 1);
+void CommandHandlerBase::endBatch() {
+  batching = false;
+  if (commandStreaming) {
+    flushCmd();
+  } else if (batchLength != 0) {
+    writeCmd(*outCmdStream, command, batchLength);
+    commandLength -= batchLength;
+    memmove(command, command + batchLength, commandLength + 1);
+    batchLength = 0;
+  }
+}
 
-  return command;
+/**
+ * Whether an argument of kind, see messageKind(), can be formatted as a field
+ * of type: integers as integers or numbers, floating values as numbers only,
+ * bools and strings as such.
+ */
+static bool messageFieldFits(char type, char kind) {
+  bool number = (type >= '0' && type <= '9');
+  switch (kind) {
+    case 'l':
+    case 'u':
+      return type == 'l' || type == 'u' || number;
+    case 'f':
+      return number;
+    default:
+      return type == kind;
+  }
 }
 
-void CommandHandler::setOutCmdSerial(Stream &outStream) {
-  outCmdStream = &outStream;
+/**
+ * Start an out command from a template, see sendMessage(). cmdOk is false if
+ * the template does not have count fields, or if the kind of an argument does
+ * not fit its field, and nothing is sent.
+ */
+void CommandHandlerBase::beginMessage(const char *prefix, const char *fields, bool flash, const char *kinds, byte count) {
+  clearCmd();
+  messageFields = fields;
+  messageFlash = flash;
+  for (byte i = 0; i <= count; i++) {
+    char type = nextMessageField();
+    if ((i == count) ? (type != STRING_NULL_TERM) : (type == STRING_NULL_TERM || !messageFieldFits(type, kinds[i]))) {
+      cmdOk = false;
+      #ifdef COMMANDHANDLER_DEBUG
+        Serial.println("Fields do not match the message");
+      #endif
+      return;
+    }
+  }
+  messageFields = fields;
+  if (flash) {
+    addCmdString(reinterpret_cast<const __FlashStringHelper *>(prefix));
+  } else {
+    addCmdString(prefix);
+  }
+}
+
+/**
+ * An integer field, as an integer or a number with decimals. A negative value
+ * does not fit an unsigned field and sets cmdOk to false.
+ */
+void CommandHandlerBase::addMessageLong(char type, long value) {
+  if (type == 'l') {
+    addCmdLong(value);
+  } else if (type != 'u') {
+    addCmdDouble(value, type - '0');
+  } else if (value >= 0) {
+    addCmdUnsigned(value);
+  } else {
+    cmdOk = false;
+  }
+}
+
+void CommandHandlerBase::addMessageUnsigned(char type, unsigned long value) {
+  if (type == 'u') {
+    addCmdUnsigned(value);
+  } else if (type != 'l') {
+    addCmdDouble(value, type - '0');
+  } else if (value <= LONG_MAX) {
+    addCmdLong(value);
+  } else {
+    cmdOk = false;
+  }
+}
+
+char CommandHandlerBase::nextMessageField() {
+  char type = messageFlash ? pgm_read_byte(messageFields) : *messageFields;
+  messageFields++;
+  return type;
+}
+
+void CommandHandlerBase::endMessage() {
+  addCmdTerm();
+  sendCmdSerial();
+}
+
+/**
+ * Queue the out commands sent to the stream of queue, usually the out stream,
+ * instead of waiting for room in its transmit buffer. Streaming out commands
+ * are not queued. Several handlers can use the same queue. The stream must
+ * tell its room with availableForWrite(), see CommandHandlerTxQueue.
+ */
+void CommandHandlerBase::setTxQueue(CommandHandlerTxQueue &queue) {
+  txQueue = &queue;
+}
+
+void CommandHandlerBase::flush() {
+  if (txQueue != NULL) {
+    txQueue->flush();
+  }
+}
+
+/*****************************************
+ * Queue of out commands
+ *****************************************/
+
+CommandHandlerTxQueue::CommandHandlerTxQueue(Stream &newstream, byte *newdata, unsigned int newsize, Policy newpolicy)
+  : stream(newstream),
+    data(newdata),
+    size(newsize),
+    head(0),
+    used(0),
+    sent(0),
+    policy(newpolicy),
+    dropped(0)
+{
+}
+
+void CommandHandlerTxQueue::setPolicy(Policy newpolicy) {
+  policy = newpolicy;
+}
+
+Stream &CommandHandlerTxQueue::getStream() {
+  return stream;
+}
+
+unsigned int CommandHandlerTxQueue::getPending() {
+  return used;
+}
+
+unsigned long CommandHandlerTxQueue::getDropped() {
+  return dropped;
+}
+
+void CommandHandlerTxQueue::dropOldest() {
+  unsigned int length = data[head] + 1;
+  head = (head + length) % size;
+  used -= length;
+  dropped++;
+}
+
+/**
+ * Write the command at once if nothing is queued and the stream has room for
+ * it, queue it otherwise. A command being written is never dropped, so that
+ * none is ever cut on the wire.
+ */
+bool CommandHandlerTxQueue::push(const char *frame, byte length) {
+  flush();
+  if (used == 0 && stream.availableForWrite() >= length) {
+    stream.write((const uint8_t *) frame, length);
+    return true;
+  }
+
+  unsigned int needed = length + 1;
+  // a command larger than the whole queue would never fit, the others stay
+  if (policy == DROP_OLDEST && needed <= size) {
+    while (size - used < needed && used > 0 && sent == 0) {
+      dropOldest();
+    }
+  }
+  if (size - used < needed) {
+    dropped++;
+    return false;
+  }
+
+  unsigned int tail = (head + used) % size;
+  data[tail] = length;
+  tail = (tail + 1) % size;
+  unsigned int first = (length < size - tail) ? length : size - tail;  // up to the end of the ring
+  memcpy(data + tail, frame, first);
+  memcpy(data, frame + first, length - first);
+  used += needed;
+  return true;
+}
+
+/**
+ * Write as much of the queued commands as the stream has room for, in at
+ * most two writes per command as the ring wraps.
+ */
+void CommandHandlerTxQueue::flush() {
+  while (used > 0) {
+    int room = stream.availableForWrite();
+    if (room <= 0) {
+      return;
+    }
+    byte length = data[head];
+    unsigned int start = (head + 1 + sent) % size;
+    unsigned int count = length - sent;
+    if (count > size - start) {
+      count = size - start;
+    }
+    if (count > (unsigned int) room) {
+      count = room;
+    }
+    size_t written = (count > 0) ? stream.write(data + start, count) : 0;
+    sent += written;
+    if (sent == length) {
+      head = (head + 1 + length) % size;
+      used -= 1 + length;
+      sent = 0;
+    } else if (written < count || written == 0) {
+      return;
+    }
+  }
+}
+
+/*****************************************
+ * Queue of commands received
+ *****************************************/
+
+CommandHandlerFrameQueue::CommandHandlerFrameQueue(char *newdata, byte newslots, byte newframeSize)
+  : data(newdata),
+    slots(newslots),
+    frameSize(newframeSize),
+    head(0),
+    tail(0),
+    highWater(0),
+    overflows(0)
+{
+}
+
+byte CommandHandlerFrameQueue::getPending() {
+  byte first = head;
+  byte last = tail;
+  return (last + slots - first) % slots;
+}
+
+byte CommandHandlerFrameQueue::getHighWater() {
+  return highWater;
+}
+
+/**
+ * The count may be updated by an interrupt while it is read a byte at a time,
+ * read it again until it is the same twice.
+ */
+unsigned long CommandHandlerFrameQueue::getOverflows() {
+  unsigned long count;
+  do {
+    count = overflows;
+  } while (count != overflows);
+  return count;
 }
 
-void CommandHandler::sendCmdSerial() {
-  sendCmdSerial(*outCmdStream);
+char *CommandHandlerFrameQueue::slotAt(byte index) {
+  return data + index * (slotHeader + frameSize + 2);
 }
 
-void CommandHandler::sendCmdSerial(Stream &outStream) {
-  outStream.print(commandString);
+/**
+ * Copy a command into the next free slot, along with the stream it came from
+ * and the time it was received, that of its context when dispatched.
+ * The slot is handed to the consumer only once filled.
+ */
+bool CommandHandlerFrameQueue::push(const char *frame, byte length, Stream *origin, unsigned long time) {
+  byte next = (tail + 1) % slots;
+  if (next == head || length > frameSize) {
+    overflows++;
+    return false;
+  }
+
+  char *slot = slotAt(tail);
+  memcpy(slot, &origin, sizeof(origin));
+  memcpy(slot + sizeof(origin), &time, sizeof(time));
+  slot[slotHeader - 1] = length;
+  memcpy(slot + slotHeader, frame, length);
+  __asm__ __volatile__("" ::: "memory");
+  tail = next;
+
+  byte pending = getPending();
+  if (pending > highWater) {
+    highWater = pending;
+  }
+  return true;
 }
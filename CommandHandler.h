@@ -33,12 +33,27 @@
 #else
   #include <WProgram.h>
 #endif
+#include <stddef.h>
 #include <string.h>
+#include <limits.h>
 
 // Size of the input buffer in bytes (maximum length of one command plus arguments)
 #define COMMANDHANDLER_BUFFER 64
 // Maximum length of a command excluding the terminating null
 #define COMMANDHANDLER_MAXCOMMANDLENGTH 8
+// Number of tokens (command and arguments) indexed as they are received, more are found by scanning
+#define COMMANDHANDLER_MAXTOKENS 8
+// Maximum number of characters read at once from a stream by processSerial(), on the stack
+#ifndef COMMANDHANDLER_SERIAL_CHUNK
+  #if defined(__AVR__)
+    #define COMMANDHANDLER_SERIAL_CHUNK 16
+  #else
+    #define COMMANDHANDLER_SERIAL_CHUNK 64
+  #endif
+#endif
+// Prefixes of an array argument packed as big-endian values, in hex or base64, see readIntArray()
+#define COMMANDHANDLER_HEX_PREFIX '#'
+#define COMMANDHANDLER_BASE64_PREFIX '$'
 // Default delimitor and terminator
 #define COMMANDHANDLER_DEFAULT_DELIM ","
 #define COMMANDHANDLER_DEFAULT_TERM ';'
@@ -48,38 +63,321 @@
 // Uncomment the next line to run the library in debug mode (verbose messages)
 // #define COMMANDHANDLER_DEBUG
 
+class CommandHandlerBase;
+
+// Position of a token in the buffer, from start to the delimiter or end that follows it
+struct CommandHandlerToken {
+  byte start;
+  byte end;
+};
+
+// Command/handler dictionary entry, shared by commands and relays alike
+struct CommandHandlerCallback {
+  // Kinds of entries in the dictionary
+  enum Kind {
+    COMMAND,      // void function()
+    RELAY,        // void function(const char *remaining)
+    OBJECT_RELAY, // void function(const char *remaining, void *pt2Object)
+    HANDLER_RELAY, // pt2Object is the CommandHandlerBase given the remaining, no function
+    TYPED_COMMAND, // void function(CommandHandlerBase &, void *pt2Object) decoding the arguments for pt2Object, see addCommand()
+    INDEXED_RELAY // command followed by an index into the CommandHandlerArray pt2Object, relayed as OBJECT_RELAY, or HANDLER_RELAY without function
+  };
+
+  // Function of any kind, built from its own signature without a cast, so
+  // that entries can be declared constexpr
+  union Function {
+    void (*command)();
+    void (*relay)(const char *);
+    void (*objectRelay)(const char *, void*);
+    void (*typed)(CommandHandlerBase &, void *);
+
+    Function() = default;
+    constexpr Function(void (*function)()) : command(function) {}
+    constexpr Function(void (*function)(const char *)) : relay(function) {}
+    constexpr Function(void (*function)(const char *, void*)) : objectRelay(function) {}
+    constexpr Function(void (*function)(CommandHandlerBase &, void *)) : typed(function) {}
+  };
+
+  byte kind;
+  void* pt2Object;
+  Function function;  // the member given by kind
+  char command[COMMANDHANDLER_MAXCOMMANDLENGTH + 1];  // in a dictionary, sized by the name length of the handler instead
+};
+
+// Objects or handlers reached by an indexed relay, see CommandHandlerBase::addIndexedRelay()
+struct CommandHandlerArray {
+  void *first;
+  size_t stride;  // bytes from one to the next
+  byte count;
+};
+
+// Helpers to declare a dictionary at compile time, see CommandHandlerBase::setCommandTable()
+#define COMMANDHANDLER_COMMAND(command, function) \
+  { CommandHandlerCallback::COMMAND, NULL, static_cast<void (*)()>(function), command }
+#define COMMANDHANDLER_RELAY(command, function) \
+  { CommandHandlerCallback::RELAY, NULL, static_cast<void (*)(const char *)>(function), command }
+#define COMMANDHANDLER_OBJECT_RELAY(command, function, pt2Object) \
+  { CommandHandlerCallback::OBJECT_RELAY, (void*) (pt2Object), static_cast<void (*)(const char *, void*)>(function), command }
+#define COMMANDHANDLER_HANDLER_RELAY(command, handler) \
+  { CommandHandlerCallback::HANDLER_RELAY, static_cast<CommandHandlerBase *>(&(handler)), static_cast<void (*)()>(NULL), command }
+#define COMMANDHANDLER_INDEXED_RELAY(command, function, array) \
+  { CommandHandlerCallback::INDEXED_RELAY, static_cast<CommandHandlerArray *>(&(array)), static_cast<void (*)(const char *, void*)>(function), command }
+
+// Whether the commands of a table are sorted, as setCommandTable() needs for a
+// binary search. For a table declared constexpr, it can be checked at compile time:
+//   static_assert(commandHandlerTableSorted(commands), "commands must be sorted by name");
+constexpr int commandHandlerCompare(const char *a, const char *b) {
+  return (*a != *b || *a == '\0') ? (unsigned char) *a - (unsigned char) *b : commandHandlerCompare(a + 1, b + 1);
+}
+
+template <size_t N>
+constexpr bool commandHandlerTableSorted(const CommandHandlerCallback (&table)[N], size_t i = 1) {
+  return i >= N || (commandHandlerCompare(table[i - 1].command, table[i].command) <= 0 && commandHandlerTableSorted(table, i + 1));
+}
+
+
+// Where and when the command being dispatched was received, see CommandHandlerBase::getContext()
+struct CommandHandlerContext {
+  Stream *origin;          // stream the command was read from, NULL if it was given otherwise (string, char, frame)
+  unsigned long time;      // millis() when it was dispatched
+  unsigned long sequence;  // number of commands received by all handlers so far, this one included
+  Stream *reply;           // stream replies go to, the origin if it is an input added with addInput(), NULL for the out stream
+};
+
+/**
+ * Parse state of one input stream of a handler reading several, see
+ * CommandHandlerBase::addInput(). Its storage is provided by CommandHandlerInputT.
+ */
+class CommandHandlerInput {
+  public:
+    Stream &getStream();
+
+  protected:
+    CommandHandlerInput(Stream &newstream, char *newbuffer, byte newbufferSize,
+                        CommandHandlerToken *newtokens, byte newtokenCapacity);
+
+  private:
+    friend class CommandHandlerBase;
+
+    Stream &stream;
+    CommandHandlerInput *nextInput;     // Next input of the same handler
+
+    // Swapped with those of the handler while it parses this input
+    char *buffer;
+    byte bufferSize;
+    byte bufPos;
+    CommandHandlerToken *tokens;
+    byte tokenCapacity;
+    byte tokenCount;
+    bool inToken;
+    bool tokenOverflow;
+};
+
+/**
+ * Parse state of an input stream, with a buffer for commands of up to
+ * BufSize chars of which the first MaxTokens tokens are indexed.
+ * Example: CommandHandlerInputT<32> peerInput(Serial1);
+ */
+template <size_t BufSize = COMMANDHANDLER_BUFFER, size_t MaxTokens = COMMANDHANDLER_MAXTOKENS>
+class CommandHandlerInputT : public CommandHandlerInput {
+  static_assert(BufSize > 0 && BufSize < 255, "BufSize must be between 1 and 254");
+  static_assert(MaxTokens > 0 && MaxTokens < 255, "MaxTokens must be between 1 and 254");
+
+  public:
+    CommandHandlerInputT(Stream &newstream)
+      : CommandHandlerInput(newstream, bufferData, BufSize, tokenData, MaxTokens) {}
+
+  private:
+    char bufferData[BufSize + 2];  // room to append the term to remaining() in place
+    CommandHandlerToken tokenData[MaxTokens];
+};
+
+/**
+ * Template of an out command whose layout does not change, e.g. a periodic
+ * sensor reading: its constant start, header and delimiters included, and the
+ * type of each field that follows. See CommandHandlerBase::sendMessage().
+ * Both strings, and the template itself, can be stored in flash:
+ *   const char temperaturePrefix[] PROGMEM = "FB,TEMP,";
+ *   const char temperatureFields[] PROGMEM = "l2";
+ *   const CommandHandlerMessage temperature PROGMEM = {temperaturePrefix, temperatureFields};
+ */
+struct CommandHandlerMessage {
+  const char *prefix;  // constant start of the command, up to the first field
+  const char *fields;  // one char per field: 'l' integer, 'u' unsigned, 'b' bool, 's' string, '0' to '9' number with as many decimals
+};
+
+/**
+ * A queue of out commands waiting for room in the transmit buffer of stream,
+ * so that sendCmdSerial() never blocks. Commands are written as room becomes
+ * available, by flush() which processSerial() also calls, according to
+ * stream.availableForWrite(). When the queue is full, either the new command
+ * (DROP_NEWEST) or the oldest ones not being written yet (DROP_OLDEST) are
+ * dropped, and counted. Its storage is provided by CommandHandlerTxQueueT.
+ * The stream must override availableForWrite(), which Print answers 0 by
+ * default: nothing would ever be written.
+ */
+class CommandHandlerTxQueue {
+  public:
+    enum Policy {
+      DROP_NEWEST,
+      DROP_OLDEST
+    };
+
+    bool push(const char *frame, byte length);  // queue a command, or write it at once if there is room; false if it was dropped
+    void flush();                               // write what the stream has room for, without blocking
+    void setPolicy(Policy newpolicy);
+    Stream &getStream();
+    unsigned int getPending();                  // bytes queued
+    unsigned long getDropped();                 // commands dropped since the start
+
+  protected:
+    CommandHandlerTxQueue(Stream &newstream, byte *newdata, unsigned int newsize, Policy newpolicy);
+
+  private:
+    Stream &stream;
+    byte *data;          // ring of commands, each preceded by its length
+    unsigned int size;
+    unsigned int head;   // length of the oldest command
+    unsigned int used;
+    byte sent;           // bytes of the oldest command already written
+    Policy policy;
+    unsigned long dropped;
+
+    void dropOldest();
+};
+
+/**
+ * A queue of Size bytes, each command taking its length plus one.
+ * Example: CommandHandlerTxQueueT<256> txQueue(Serial);
+ */
+template <unsigned int Size>
+class CommandHandlerTxQueueT : public CommandHandlerTxQueue {
+  static_assert(Size > 1, "Size must be at least 2");
+
+  public:
+    CommandHandlerTxQueueT(Stream &newstream, Policy newpolicy = DROP_NEWEST)
+      : CommandHandlerTxQueue(newstream, queueData, Size, newpolicy) {}
+
+  private:
+    byte queueData[Size];
+};
 
-class CommandHandler {
+/**
+ * Complete commands received, waiting to be dispatched by dispatchPending().
+ * Filled by one producer, processChar() possibly called from an interrupt or
+ * serialEvent(), and emptied by one consumer, dispatchPending() from loop(),
+ * without disabling interrupts: each side only writes its own one byte index.
+ */
+class CommandHandlerFrameQueue {
+  public:
+    byte getPending();            // commands waiting to be dispatched
+    byte getHighWater();          // most commands ever waiting at once, to size the queue
+    unsigned long getOverflows(); // commands dropped since the start, the queue being full or the command too long
+
+  protected:
+    CommandHandlerFrameQueue(char *newdata, byte newslots, byte newframeSize);
+
+  protected:
+    // each slot starts with the origin stream, the time received and the length
+    static const byte slotHeader = sizeof(Stream *) + sizeof(unsigned long) + 1;
+
+  private:
+    friend class CommandHandlerBase;
+
+    char *data;                   // slots of the header and the command
+    byte slots;                   // one more than the commands it can hold
+    byte frameSize;
+    volatile byte head;           // next slot to dispatch, written by the consumer only
+    volatile byte tail;           // next slot to fill, written by the producer only
+    volatile byte highWater;
+    volatile unsigned long overflows;
+
+    char *slotAt(byte index);
+    bool push(const char *frame, byte length, Stream *origin, unsigned long time);
+};
+
+/**
+ * A queue of Frames commands of up to FrameSize chars each.
+ * Example: CommandHandlerFrameQueueT<8, 64> frameQueue;
+ */
+template <byte Frames, byte FrameSize = COMMANDHANDLER_BUFFER>
+class CommandHandlerFrameQueueT : public CommandHandlerFrameQueue {
+  static_assert(Frames > 0 && Frames < 255, "Frames must be between 1 and 254");
+  static_assert(FrameSize > 0 && FrameSize < 255, "FrameSize must be between 1 and 254");
+
+  public:
+    CommandHandlerFrameQueueT()
+      : CommandHandlerFrameQueue(queueData, Frames + 1, FrameSize) {}
+
+  private:
+    // room to append the term to remaining() in place, as in the input buffer
+    char queueData[(Frames + 1) * (slotHeader + FrameSize + 2)];
+};
+
+
+// The parsing and forging engine, working on buffers provided by a subclass
+// Use CommandHandler, or CommandHandlerT<> to choose the buffer sizes
+class CommandHandlerBase {
   public:
-    CommandHandler(const char *newdelim = COMMANDHANDLER_DEFAULT_DELIM, const char newterm = COMMANDHANDLER_DEFAULT_TERM);   // Constructor
     void addCommand(const char *command, void(*function)());  // Add a command to the processing dictionary.
+    template <typename... Args>
+    void addCommand(const char *command, void (*function)(Args...));  // Add a command whose arguments are read and given to function, e.g. void move(int steps, float speed)
+    void setArgErrorHandler(void (*function)(const char *command, byte index));  // A handler to call when an argument of such a command is missing or invalid.
+    void addRelay(const char *command, void (*function)(const char *));  // Add a command to the relay dictionary. Such relay are given the remaining of the command.
     void addRelay(const char *command, void (*function)(const char *, void*), void* pt2Object = NULL);  // Add a command to the relay dictionary. Such relay are given the remaining of the command. pt2Object is the reference to the instance associated with the callback, it will be given as the second argument of the callback function, default is NULL
+    void addRelay(const char *command, CommandHandlerBase &handler);  // Add a command whose remaining is directly parsed by another handler, without copy.
+    template <typename T, size_t N>
+    void addIndexedRelay(const char *prefix, void (*function)(const char *, void*), T (&objects)[N]);  // Relay prefix followed by an index i, e.g. "P12", giving &objects[i] as pt2Object
+    template <typename T, size_t N>
+    void addIndexedRelay(const char *prefix, T (&handlers)[N]);  // Relay prefix followed by an index i to handlers[i], as addRelay() does to a handler
+    void addIndexedRelay(const char *prefix, void (*function)(const char *, void*), void *first, size_t stride, byte count);
+    void setCommandTable(const CommandHandlerCallback *table, byte count);  // Use a PROGMEM dictionary declared at compile time, sorted by command
+    template <size_t N>
+    void setCommandTable(const CommandHandlerCallback (&table)[N]) { setCommandTable(table, N); }
     void setDefaultHandler(void (*function)(const char *));   // A handler to call when no valid command received.
     void setDefaultHandler(void (*function)(const char *, void*), void* pt2Object);   // A handler to call when no valid command received.
 
     void setInCmdSerial(Stream &inStream); // define to which serial to send the read commands
     void processSerial();  // Process what on the in stream
     void processSerial(Stream &inStream);  // Process what on the designated stream
+    void addInput(CommandHandlerInput &input);  // Also read commands from the stream of input, with its own parse state
+    void processInputs();  // Process what is available on each input, in turn
     void processString(const char *inString); // Process a String
+    void processBuffer(const char *data, size_t length); // Process length characters at once
     void processChar(char inChar); //Process a char
+    void processFrame(char *data, size_t length); // Process a complete command without its term, in place
+    void setFrameQueue(CommandHandlerFrameQueue &queue); // queue the commands received instead of dispatching them at once...
+    byte dispatchPending(byte maxFrames = 255); // ...dispatched here, at most maxFrames of them, returns how many
     void clearBuffer();   // Clears the input buffer.
     char *remaining();         // Returns pointer to remaining of the command buffer (for getting arguments to commands).
     char *next();         // Returns pointer to next token found in command buffer (for getting arguments to commands).
+    char *arg(byte index);  // Returns pointer to the argument at index, 0 being the first after the command, NULL if missing.
+    byte argCount();        // Returns the number of arguments of the command.
 
     // helpers to cast next into different types
     bool argOk; // this variable is set after the below function are run, it tell you if thing went well
     bool readBoolArg();
     int readIntArg();
     long readLongArg();
+    long readFixedArg(byte scale);  // decimal number as a long scaled by 10^scale, without floating point
     float readFloatArg();
     double readDoubleArg();
     char *readStringArg();
     bool compareStringArg(const char *stringToCompare);
+    template <typename T>
+    T readArg();  // read the next argument as T, among the types above
+
+    // helpers to read all the remaining arguments into an array, return the number of values read
+    size_t readIntArray(int16_t *values, size_t max);
+    size_t readLongArray(int32_t *values, size_t max);
+    size_t readFixedArray(int32_t *values, size_t max, byte scale);
+    size_t readFloatArray(float *values, size_t max);
 
     //helpers to create a message
-    void setCmdHeader(const char *cmdHeader, bool addDelim = true); // setting a char to be added at the start of each out message (default "")
+    void setCmdHeader(const char *cmdHeader, bool addDelim = true); // setting a char to be added at the start of each out message (default ""), copied
     void initCmd(); // initialize the command buffer  to build next message to be sent
 
+    bool cmdOk; // false once the out command did not fit in its buffer, until initCmd() or clearCmd()
     void clearCmd(); // clear the output command
     void addCmdDelim();
     void addCmdTerm();
@@ -95,31 +393,67 @@ class CommandHandler {
     void addCmdDouble(double value, byte decimal);
 
     void addCmdString(const char *value);
+    void addCmdString(const __FlashStringHelper *value);
 
     char* getOutCmd(); // get pointer to command buffer
 
     void setOutCmdSerial(Stream &outStream); // define to which serial to send the out commands
-    void sendCmdSerial(); //send current command thought the Stream
+    void sendCmdSerial(); //send current command thought the out Stream, or back to the input the command being dispatched by this handler came from
     void sendCmdSerial(Stream &outStream); //send current command thought the Stream
+    static const CommandHandlerContext *getContext(); // context of the command being dispatched, relays included, NULL outside of a callback
+    void setTxQueue(CommandHandlerTxQueue &queue); // queue the out commands sent to the stream of queue instead of waiting for room
+    void flush(); // write the queued out commands the out stream has room for
+    void beginBatch(); // gather the next out commands sent to the out stream into a single write...
+    void endBatch();   // ...done here
+    void setCmdStreaming(bool streaming); // write out commands to the out stream as they are built instead of keeping them whole
+
+    // build a whole command at once, header and fields separated by delim then term, e.g. sendCmd("PONG", elapsed, 3.14)
+    template <typename... Args>
+    void sendCmd(const Args&... args);  // build it in the out buffer and send it
+    template <typename... Args>
+    bool formatCmd(char *buf, size_t size, const Args&... args);  // build it null-terminated in buf, false if it did not fit
+    template <typename... Args>
+    void sendMessage(const CommandHandlerMessage &message, const Args&... args);  // send a command from a template, its fields given in order
+    template <typename... Args>
+    void sendMessage_P(const CommandHandlerMessage *message, const Args&... args);  // same with the template and its strings in flash
+
+  protected:
+    CommandHandlerBase(const char *newdelim, char newterm,
+                       char *newbuffer, byte newbufferSize,
+                       CommandHandlerToken *newtokens, byte newtokenCapacity,
+                       char *newcommand, byte newcommandSize, byte newnameLength);   // Constructor, given the buffers to work with
+    CommandHandlerBase(CommandHandlerBase &owner, const char *newdelim, char newterm);   // Constructor, sharing the buffers of owner
+    CommandHandlerBase(const CommandHandlerBase &) = delete;              // A copy would point to the buffers of the original
+    CommandHandlerBase &operator=(const CommandHandlerBase &) = delete;
 
   private:
 
-    // Command/handler dictionary
-    struct CommandHandlerCallback {
-      char command[COMMANDHANDLER_MAXCOMMANDLENGTH + 1];
-      void (*function)();
-    };                                    // Data structure to hold Command/Handler function key-value pairs
-    CommandHandlerCallback *commandList;   // Actual definition for command/handler array
+    // Command/handler dictionary, commands and relays alike, sorted by command
+    CommandHandlerCallback *commandList;   // Actual definition for command/handler array, entries are callbackSize bytes apart
     byte commandCount;
+    byte nameLength;   // Maximum length of a command excluding the terminating null
+    byte callbackSize; // Size of one entry in commandList
+    CommandHandlerCallback *callbackAt(byte index);
+
+    // Dictionary declared at compile time, stored in flash and sorted by command
+    const CommandHandlerCallback *commandTable;
+    byte commandTableCount;
+    bool commandTableSorted;
+
+    void dispatch(Stream *origin, unsigned long time);
+    void dispatchFrame(char *data, size_t length, Stream *origin, unsigned long time);
+    void invoke(const CommandHandlerCallback &callback);
+    int findCallback(const char *command, byte *insertAt = NULL);
+    bool lookupCallback(const char *command, CommandHandlerCallback *callback);
+    bool lookupIndexed(char *command, CommandHandlerCallback *callback);
+    void addCallback(const char *command, byte kind, CommandHandlerCallback::Function function, void* pt2Object);
 
-    // Relay/handler dictionary
-    struct RelayHandlerCallback {
-      char command[COMMANDHANDLER_MAXCOMMANDLENGTH + 1];
-      void* pt2Object;
-      void (*function)(const char *, void*);
-    };                                 // Data structure to hold Relay/Handler function key-value pairs
-    RelayHandlerCallback *relayList;   // Actual definition for Relay/handler array
-    byte relayCount;
+    template <typename... Args>
+    friend struct CommandHandlerTyped;
+    void (*argErrorHandler)(const char *, byte);
+    void argError(byte index);
+    unsigned long readUnsignedArg(unsigned long max);
+    size_t readArray(byte *values, size_t max, byte width, bool (*parse)(const char *, byte, byte *), byte scale);
 
     // Pointer to the default handler function
     void (*defaultHandler)(const char *);
@@ -127,18 +461,129 @@ class CommandHandler {
     void (*wrapper_defaultHandler)(const char *, void*);
 
     const char *delim; // null-terminated list of character to be used as delimeters for tokenizing (default " ")
+    byte delimMap[16]; // delim as a bitmap of 7-bit characters, plus the null char
     char term;     // Character that signals end of command (default '\n')
 
-    char buffer[COMMANDHANDLER_BUFFER + 1]; // Buffer of stored characters while waiting for terminator character
+    char *buffer;                       // Buffer of stored characters while waiting for terminator character, bufferSize + 2 bytes
+    byte bufferSize;                    // Maximum length of one command plus arguments
     byte bufPos;                        // Current position in the buffer
-    char *last;                         // State variable used by strtok_r during processing
 
-    char remains[COMMANDHANDLER_BUFFER + 1]; // Buffer of stored characters to pass to a relay function
+    // Index of the tokens in the buffer, filled as characters are received
+    CommandHandlerToken *tokens;
+    byte tokenCapacity;
+    byte tokenCount;
+    bool inToken;                       // The last character stored belongs to tokens[tokenCount - 1]
+    bool tokenOverflow;                 // More tokens than tokenCapacity were received
+
+    CommandHandlerInput *inputs;        // Further input streams, with their own parse state
+    Stream *inputStream;                // Stream being read, if any
+    Stream *replyStream;                // Stream replies go to while a command is dispatched by this handler, NULL for the out stream
+    CommandHandlerBase *bufferOwner;    // Handler whose receive buffer is shared, see CommandHandlerShared
+    CommandHandlerFrameQueue *frameQueue;   // Commands received waiting for dispatchPending(), if any
+    bool dispatchingPending;            // dispatchPending() is running, the receive buffer belongs to the producer
+
+    static CommandHandlerContext *currentContext;
+    static unsigned long commandSequence;
+    void swapInput(CommandHandlerInput &input);
+    bool isInput(Stream *stream);
+    void followOwner();
+    bool feedingPending();
+    bool readStream(Stream &inStream);
+
+    // Command being parsed and position of the next token to read. It is in
+    // the buffer of this handler, or of the handler that relayed it
+    struct Frame {
+      char *command;                    // Command being dispatched
+      char *data;
+      size_t length;
+      CommandHandlerToken *tokens;
+      byte tokenCount;
+      byte tokenPos;                    // Next token to read from the index
+      size_t scanPos;                   // Past the index, where to scan for the next token
+      byte argPos;                      // Position of the first argument, for arg()
+      size_t argScanPos;
+    } frame;
+
+    bool isDelim(char c);
+    void indexChar(char inChar, byte pos);
+    void processReceived();
+    char *tokenAt(byte index);
+    char *scanToken(size_t *pos, bool terminate);
 
-    char command[COMMANDHANDLER_BUFFER + 1];
-    String commandString; // Out Command
-    String commandHeader; // header for out command
+    char *command;                      // Out command as given by getOutCmd(), commandSize + 1 bytes
+    byte commandSize;
+    byte commandLength;                 // Length of the out command, the append cursor in command
+    char *commandHeader;                // header for out command, a copy, NULL if none
+    bool commandHeaderDelim;            // whether a delim follows the header
     byte commandDecimal;
+    bool commandStreaming;              // out commands are written to cmdStream() as they are built
+    CommandHandlerTxQueue *txQueue;
+    bool batching;
+    byte batchLength;                   // Length of the batched out commands, the current one follows them
+
+    void writeCmd(Stream &outStream, const char *data, byte length);
+    Stream &cmdStream();
+
+    void appendCmd(const char *value, size_t length);
+    void flushCmd();
+    void addCmdUnsigned(unsigned long value);
+
+    // one field of sendCmd() and formatCmd(), according to its type
+    void addCmdField(bool value) { addCmdBool(value); }
+    void addCmdField(char value) { appendCmd(&value, 1); }
+    void addCmdField(int value) { addCmdLong(value); }
+    void addCmdField(unsigned int value) { addCmdUnsigned(value); }
+    void addCmdField(long value) { addCmdLong(value); }
+    void addCmdField(unsigned long value) { addCmdUnsigned(value); }
+    void addCmdField(double value) { addCmdDouble(value, commandDecimal); }
+    void addCmdField(const char *value) { addCmdString(value); }
+    void addCmdField(const __FlashStringHelper *value) { addCmdString(value); }
+
+    // fields of sendMessage(), formatted according to the type chars of the template
+    const char *messageFields;
+    bool messageFlash;
+    void beginMessage(const char *prefix, const char *fields, bool flash, const char *kinds, byte count);
+    void endMessage();
+    char nextMessageField();
+    void addMessageLong(char type, long value);
+    void addMessageUnsigned(char type, unsigned long value);
+    // kind of each argument type, checked against the type char: l signed, u unsigned, f floating, b bool, s string
+    static char messageKind(bool) { return 'b'; }
+    static char messageKind(char) { return 's'; }
+    static char messageKind(signed char) { return 'l'; }
+    static char messageKind(short) { return 'l'; }
+    static char messageKind(int) { return 'l'; }
+    static char messageKind(long) { return 'l'; }
+    static char messageKind(unsigned char) { return 'u'; }
+    static char messageKind(unsigned short) { return 'u'; }
+    static char messageKind(unsigned int) { return 'u'; }
+    static char messageKind(unsigned long) { return 'u'; }
+    static char messageKind(float) { return 'f'; }
+    static char messageKind(double) { return 'f'; }
+    static char messageKind(const char *) { return 's'; }
+    static char messageKind(const __FlashStringHelper *) { return 's'; }
+    void addMessageField(char /* type */, bool value) { addCmdBool(value); }
+    void addMessageField(char /* type */, char value) { appendCmd(&value, 1); }
+    void addMessageField(char type, signed char value) { addMessageLong(type, value); }
+    void addMessageField(char type, short value) { addMessageLong(type, value); }
+    void addMessageField(char type, int value) { addMessageLong(type, value); }
+    void addMessageField(char type, long value) { addMessageLong(type, value); }
+    void addMessageField(char type, unsigned char value) { addMessageUnsigned(type, value); }
+    void addMessageField(char type, unsigned short value) { addMessageUnsigned(type, value); }
+    void addMessageField(char type, unsigned int value) { addMessageUnsigned(type, value); }
+    void addMessageField(char type, unsigned long value) { addMessageUnsigned(type, value); }
+    void addMessageField(char type, double value) { addCmdDouble(value, type - '0'); }
+    void addMessageField(char /* type */, const char *value) { addCmdString(value); }
+    void addMessageField(char /* type */, const __FlashStringHelper *value) { addCmdString(value); }
+    void addMessageFields() {}
+    template <typename T, typename... Rest>
+    void addMessageFields(const T &value, const Rest&... rest);
+
+    void addCmdFields() {}
+    template <typename T>
+    void addCmdFields(const T &value) { addCmdField(value); }
+    template <typename T, typename... Rest>
+    void addCmdFields(const T &value, const Rest&... rest);
 
 
     // in and out default strem
@@ -146,4 +591,220 @@ class CommandHandler {
     Stream *outCmdStream;
 };
 
+/**
+ * Indexed relays to the elements of an array, from a single dictionary entry.
+ */
+template <typename T, size_t N>
+void CommandHandlerBase::addIndexedRelay(const char *prefix, void (*function)(const char *, void*), T (&objects)[N]) {
+  static_assert(N < 256, "At most 255 objects");
+  addIndexedRelay(prefix, function, &objects[0], sizeof(T), N);
+}
+
+template <typename T, size_t N>
+void CommandHandlerBase::addIndexedRelay(const char *prefix, T (&handlers)[N]) {
+  static_assert(N < 256, "At most 255 handlers");
+  addIndexedRelay(prefix, NULL, static_cast<CommandHandlerBase *>(&handlers[0]), sizeof(T), N);
+}
+
+/**
+ * One-call out commands: each argument is added with the addCmd* helper of
+ * its type, the overload being picked at compile time.
+ */
+template <typename T, typename... Rest>
+void CommandHandlerBase::addCmdFields(const T &value, const Rest&... rest) {
+  addCmdField(value);
+  addCmdDelim();
+  addCmdFields(rest...);
+}
+
+template <typename... Args>
+void CommandHandlerBase::sendCmd(const Args&... args) {
+  initCmd();
+  addCmdFields(args...);
+  addCmdTerm();
+  sendCmdSerial();
+}
+
+/**
+ * Builds the command in buf instead of the out buffer, which is left as is.
+ */
+template <typename... Args>
+bool CommandHandlerBase::formatCmd(char *buf, size_t size, const Args&... args) {
+  if (size == 0) {
+    return false;
+  }
+  char *ownCommand = command;
+  byte ownSize = commandSize;
+  byte ownLength = commandLength;
+  bool ownOk = cmdOk;
+  bool ownStreaming = commandStreaming;
+  bool ownBatching = batching;
+  byte ownBatchLength = batchLength;
+
+  command = buf;
+  commandStreaming = false;
+  batching = false;
+  batchLength = 0;
+  commandSize = (size > 255) ? 254 : size - 1;
+  initCmd();
+  addCmdFields(args...);
+  addCmdTerm();
+  bool ok = cmdOk;
+
+  command = ownCommand;
+  commandSize = ownSize;
+  commandLength = ownLength;
+  cmdOk = ownOk;
+  commandStreaming = ownStreaming;
+  batching = ownBatching;
+  batchLength = ownBatchLength;
+  return ok;
+}
+
+/**
+ * Message templates: the constant start is copied at once, then each field is
+ * formatted according to its type char, with a delim between them.
+ */
+template <typename T, typename... Rest>
+void CommandHandlerBase::addMessageFields(const T &value, const Rest&... rest) {
+  addMessageField(nextMessageField(), value);
+  if (sizeof...(Rest) > 0) {
+    addCmdDelim();
+  }
+  addMessageFields(rest...);
+}
+
+template <typename... Args>
+void CommandHandlerBase::sendMessage(const CommandHandlerMessage &message, const Args&... args) {
+  const char kinds[] = {messageKind(args)..., 0};
+  beginMessage(message.prefix, message.fields, false, kinds, sizeof...(Args));
+  if (cmdOk) {
+    addMessageFields(args...);
+    endMessage();
+  }
+}
+
+template <typename... Args>
+void CommandHandlerBase::sendMessage_P(const CommandHandlerMessage *message, const Args&... args) {
+  CommandHandlerMessage copy;
+  memcpy_P(&copy, message, sizeof(copy));
+  const char kinds[] = {messageKind(args)..., 0};
+  beginMessage(copy.prefix, copy.fields, true, kinds, sizeof...(Args));
+  if (cmdOk) {
+    addMessageFields(args...);
+    endMessage();
+  }
+}
+
+/**
+ * Typed commands: their arguments are read one after the other with readArg<T>()
+ * then given to the function, or the argument error handler is called instead.
+ */
+template <typename... Types>
+struct CommandHandlerTypes {};
+
+template <typename... Args>
+struct CommandHandlerTyped {
+  typedef void (*Function)(Args...);
+
+  static void call(CommandHandlerBase &handler, void *function) {
+    read((Function) function, handler, CommandHandlerTypes<Args...>());
+  }
+
+  // all arguments are read, there must not be any more
+  template <typename... Values>
+  static void read(Function function, CommandHandlerBase &handler, CommandHandlerTypes<>, Values... values) {
+    if (handler.next() != NULL) {
+      handler.argError(sizeof...(Values));
+      return;
+    }
+    (*function)(values...);
+  }
+
+  template <typename Next, typename... Rest, typename... Values>
+  static void read(Function function, CommandHandlerBase &handler, CommandHandlerTypes<Next, Rest...>, Values... values) {
+    Next value = handler.readArg<Next>();
+    if (!handler.argOk) {
+      handler.argError(sizeof...(Values));
+      return;
+    }
+    read(function, handler, CommandHandlerTypes<Rest...>(), values..., value);
+  }
+};
+
+/**
+ * Adds a command whose arguments are read according to the signature of
+ * function, then given to it. Arguments can be bool, int, unsigned int, long,
+ * unsigned long, byte, float, double and char * or const char *. If one is missing or cannot be read, or if there
+ * are too many, the handler set by setArgErrorHandler() is called instead.
+ */
+template <typename... Args>
+void CommandHandlerBase::addCommand(const char *command, void (*function)(Args...)) {
+  addCallback(command, CommandHandlerCallback::TYPED_COMMAND,
+              &CommandHandlerTyped<Args...>::call, reinterpret_cast<void *>(function));
+}
+
+// other types, references included, are refused at compile time
+template <typename T>
+T CommandHandlerBase::readArg() {
+  static_assert(sizeof(T) == 0, "readArg<T>() and typed commands take bool, int, unsigned int, long, unsigned long, byte, float, double, char * or const char *");
+}
+
+template <> inline bool CommandHandlerBase::readArg<bool>() { return readBoolArg(); }
+template <> inline int CommandHandlerBase::readArg<int>() { return readIntArg(); }
+template <> inline long CommandHandlerBase::readArg<long>() { return readLongArg(); }
+template <> inline float CommandHandlerBase::readArg<float>() { return readFloatArg(); }
+template <> inline double CommandHandlerBase::readArg<double>() { return readDoubleArg(); }
+template <> inline char *CommandHandlerBase::readArg<char *>() { return readStringArg(); }
+template <> inline const char *CommandHandlerBase::readArg<const char *>() { return readStringArg(); }
+template <> inline byte CommandHandlerBase::readArg<byte>() { return readUnsignedArg(UCHAR_MAX); }
+template <> inline unsigned int CommandHandlerBase::readArg<unsigned int>() { return readUnsignedArg(UINT_MAX); }
+template <> inline unsigned long CommandHandlerBase::readArg<unsigned long>() { return readUnsignedArg(ULONG_MAX); }
+
+/**
+ * A command handler owning buffers of the given sizes:
+ *  - BufSize: maximum length of a received command plus arguments
+ *  - NameLen: maximum length of a command name in the dictionary
+ *  - OutSize: maximum length of an out command returned by getOutCmd()
+ *  - MaxTokens: number of tokens indexed as they are received, further ones are scanned for
+ * Example: CommandHandlerT<16, 4> leafCmdHdl;
+ */
+template <size_t BufSize = COMMANDHANDLER_BUFFER, size_t NameLen = COMMANDHANDLER_MAXCOMMANDLENGTH, size_t OutSize = BufSize,
+          size_t MaxTokens = COMMANDHANDLER_MAXTOKENS>
+class CommandHandlerT : public CommandHandlerBase {
+  static_assert(BufSize > 0 && BufSize < 255, "BufSize must be between 1 and 254");
+  static_assert(NameLen > 0 && NameLen < 255, "NameLen must be between 1 and 254");
+  static_assert(OutSize < 255, "OutSize must be at most 254");
+  static_assert(MaxTokens > 0 && MaxTokens < 255, "MaxTokens must be between 1 and 254");
+
+  public:
+    CommandHandlerT(const char *newdelim = COMMANDHANDLER_DEFAULT_DELIM, const char newterm = COMMANDHANDLER_DEFAULT_TERM)
+      : CommandHandlerBase(newdelim, newterm, bufferData, BufSize, tokenData, MaxTokens, commandData, OutSize, NameLen) {}
+
+  private:
+    char bufferData[BufSize + 2];  // room to append the term to remaining() in place
+    CommandHandlerToken tokenData[MaxTokens];
+    char commandData[OutSize + 1];
+};
+
+/**
+ * A command handler without buffers of its own, using those of owner instead.
+ * Meant for the handlers of a relay tree, to have a single input and out command
+ * buffer for the whole tree. This is safe as long as:
+ *  - only owner receives characters, and the shared handlers are fed from within
+ *    a relay or command callback of owner, with remaining() which already lives
+ *    in the shared buffer
+ *  - an out command is built and sent (or read with getOutCmd()) within one
+ *    callback, before any other handler of the tree forges one
+ * Example: CommandHandlerShared m1CmdHdl(cmdHdl);
+ */
+class CommandHandlerShared : public CommandHandlerBase {
+  public:
+    CommandHandlerShared(CommandHandlerBase &owner, const char *newdelim = COMMANDHANDLER_DEFAULT_DELIM, const char newterm = COMMANDHANDLER_DEFAULT_TERM)
+      : CommandHandlerBase(owner, newdelim, newterm) {}
+};
+
+// The default command handler, sized by COMMANDHANDLER_BUFFER and COMMANDHANDLER_MAXCOMMANDLENGTH
+typedef CommandHandlerT<> CommandHandler;
+
 #endif //CommandHandler_h
@@ -22,6 +22,8 @@ void setup() {
   cmdHdl.addCommand("P",     processCommand);  // Converts two arguments, first to double and echos them back
   cmdHdl.addCommand("GUESS", guessMyName);     // A game for guessing my name, used to test compareStringArg
   cmdHdl.addCommand("PING", pongMesssage);     // A function that use the packet forging tool to send a random ping time
+  cmdHdl.addCommand("MOVE", moveMotor);        // Arguments are read and given to moveMotor(int steps, float speed)
+  cmdHdl.setArgErrorHandler(badArgument);      // Handler for arguments of MOVE that are missing or not numbers
   cmdHdl.setDefaultHandler(unrecognized);      // Handler for command that isn't matched  (says "What?")
 
   // You can process string directly into the arduino
@@ -100,6 +102,8 @@ void loop() {
   // FWD,FWD,FWD,P,3.5;
   // PING;
   // GUESS,Maurice;
+  // MOVE,200,1.5;
+  // MOVE,200;
 }
 
 void sayHello() {
@@ -169,17 +173,28 @@ void pongMesssage() {
   delay(random(1000));
   unsigned long elasped = millis() - start;
 
-  cmdHdl.initCmd();
-  cmdHdl.addCmdString("PONG");
-  cmdHdl.addCmdDelim();
-  cmdHdl.addCmdLong(elasped);
-  cmdHdl.addCmdTerm();
-  cmdHdl.sendCmdSerial();
+  // the same as initCmd(), addCmdString("PONG"), addCmdDelim(), addCmdLong(elasped), addCmdTerm() and sendCmdSerial()
+  cmdHdl.sendCmd("PONG", elasped);
 
   Serial.println(); // for the demo only! so the output look nice
   Serial.println("Above is the feedback command indicating the pause time.");
 }
 
+void moveMotor(int steps, float speed) {
+  Serial.print("Moving ");
+  Serial.print(steps);
+  Serial.print(" steps at ");
+  Serial.println(speed);
+}
+
+// Called instead of moveMotor() when an argument is missing or invalid, index 0 being the first argument
+void badArgument(const char *command, byte index) {
+  Serial.print("Bad argument ");
+  Serial.print(index);
+  Serial.print(" for ");
+  Serial.println(command);
+}
+
 // This gets set as the default handler, and gets called when no other command matches.
 void unrecognized(const char *command) {
   Serial.println("What?");
@@ -0,0 +1,60 @@
+// Benchmark of the command lookup of the CommandHandler Library
+// Registers 4, 16, 64 then 128 commands, and prints the time to dispatch the
+// first and the last one registered, and an unknown one, in microseconds
+
+#include <CommandHandler.h>
+
+// names of up to 4 chars, "C0" to "C127", to fit 128 commands in the RAM of an Uno
+CommandHandlerT<16, 4> cmdHdl;
+
+const unsigned int REPEAT = 1000;
+const byte SIZES[] = {4, 16, 64, 128};
+
+unsigned long calls = 0;
+
+void count() {
+  calls++;
+}
+
+void unknown(const char *command) {
+  calls++;
+}
+
+float dispatchTime(const char *command) {
+  unsigned long start = micros();
+  for (unsigned int i = 0; i < REPEAT; i++) {
+    cmdHdl.processString(command);
+  }
+  return (float) (micros() - start) / REPEAT;
+}
+
+void setup() {
+  Serial.begin(115200);
+  cmdHdl.setDefaultHandler(unknown);
+
+  char name[8];
+  char last[12];
+  byte registered = 0;
+  Serial.println("commands\tfirst\tlast\tunknown (us per command)");
+  for (byte s = 0; s < sizeof(SIZES); s++) {
+    for (; registered < SIZES[s]; registered++) {
+      sprintf(name, "C%d", registered);
+      cmdHdl.addCommand(name, count);
+    }
+    sprintf(last, "C%d;", registered - 1);
+
+    Serial.print(registered);
+    Serial.print('\t');
+    Serial.print(dispatchTime("C0;"));
+    Serial.print('\t');
+    Serial.print(dispatchTime(last));
+    Serial.print('\t');
+    Serial.println(dispatchTime("X;"));
+  }
+
+  Serial.print(calls);
+  Serial.println(" commands dispatched");
+}
+
+void loop() {
+}
@@ -0,0 +1,64 @@
+// Self check of the argument parsing of the CommandHandler Library
+// Prints PASS or FAIL for each check, then the number of failures
+
+#include <CommandHandler.h>
+
+CommandHandler cmdHdl;
+
+byte failures = 0;
+
+void check(const char *what, long value, long expected, bool ok) {
+  bool pass = ok && (value == expected);
+  if (!pass) {
+    failures++;
+  }
+  Serial.print(pass ? "PASS " : "FAIL ");
+  Serial.print(what);
+  Serial.print(": ");
+  Serial.print(value);
+  Serial.print(ok ? "" : " (argOk false)");
+  Serial.print(", expected ");
+  Serial.println(expected);
+}
+
+// FIXED,<scale>,<expected>,<number>;
+void checkFixed() {
+  byte scale = cmdHdl.readIntArg();
+  long expected = cmdHdl.readLongArg();
+  long value = cmdHdl.readFixedArg(scale);
+  check("readFixedArg", value, expected, cmdHdl.argOk);
+}
+
+// ARRAY,<expected>,<expected>,<numbers...>; read at scale 1
+void checkFixedArray() {
+  long expected[2];
+  expected[0] = cmdHdl.readLongArg();
+  expected[1] = cmdHdl.readLongArg();
+  int32_t values[8];
+  size_t count = cmdHdl.readFixedArray(values, 8, 1);
+  for (byte i = 0; i < 2; i++) {
+    check("readFixedArray", i < count ? values[i] : 0, expected[i], cmdHdl.argOk && i < count);
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  cmdHdl.addCommand("FIXED", checkFixed);
+  cmdHdl.addCommand("ARRAY", checkFixedArray);
+
+  // digits past the scale round half away from zero, however many they are
+  cmdHdl.processString("FIXED,2,123,1.2345;");
+  cmdHdl.processString("FIXED,2,-123,-1.2345;");
+  cmdHdl.processString("FIXED,2,123,1.23456789;");
+  cmdHdl.processString("FIXED,2,200,1.99999;");
+  cmdHdl.processString("FIXED,2,200,1.995;");
+  cmdHdl.processString("FIXED,2,0,0.004;");
+  cmdHdl.processString("FIXED,2,1200,12;");
+  cmdHdl.processString("ARRAY,23,0,2.345,0.04999;");
+
+  Serial.print(failures);
+  Serial.println(" failure(s)");
+}
+
+void loop() {
+}